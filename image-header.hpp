@@ -0,0 +1,756 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ */
+
+/*
+ * Reading the dimensions, the format, the EXIF orientation and the EXIF
+ * capture time of images from their headers, without decoding them.
+ * Used by img-similarity-cluster and img-search.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <ctime>
+#include <climits>
+
+#include "opencv2/core.hpp"
+
+// Timestamp of images without EXIF capture time
+const long long no_timestamp = -1;
+
+// Width of the aspect ratio buckets (logarithm of the aspect ratio)
+const double aspect_bucket_width = 0.02;
+
+// Longest ASCII value that is read from a TIFF structure (DateTimeOriginal
+// has 20 bytes)
+const uint32_t max_tiff_string = 64;
+
+/**
+ * Reads values from a TIFF structure (TIFF files and EXIF blocks)
+ */
+struct tiff_reader{
+	FILE* file;
+	long base; // file offset of the TIFF header
+	bool big_endian;
+	
+	/**
+	 * Read size bytes at offset (relative to the TIFF header)
+	 */
+	bool read( unsigned long offset, void* buffer, size_t size ) const{
+		return fseek( file, base + offset, SEEK_SET ) == 0 &&
+			fread( buffer, 1, size, file ) == size;
+	}
+	
+	uint16_t get16( const uchar* p ) const{
+		return big_endian ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+	}
+	
+	uint32_t get32( const uchar* p ) const{
+		return big_endian ?
+			(uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3] :
+			(uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+	}
+};
+
+/**
+ * An entry of a TIFF image file directory (IFD)
+ */
+struct tiff_entry{
+	uint16_t tag, type;
+	uint32_t count;
+	uchar value[4]; // the value itself or the offset of the values
+};
+
+/**
+ * Check the TIFF header at base and get the offset of the first IFD
+ * 
+ * @return false if there is no TIFF header at base
+ */
+inline bool tiff_open( FILE* file, long base, tiff_reader& reader,
+	uint32_t& first_ifd ){
+	
+	uchar header[8];
+	reader.file = file;
+	reader.base = base;
+	
+	if( !reader.read( 0, header, 8 ) )
+		return false;
+	
+	if( header[0] == 'I' && header[1] == 'I' ){
+		reader.big_endian = false;
+	} else if( header[0] == 'M' && header[1] == 'M' ){
+		reader.big_endian = true;
+	} else{
+		return false;
+	}
+	
+	// Olympus and Panasonic RAW images use their own magic numbers
+	uint16_t magic = reader.get16( header+2 );
+	first_ifd = reader.get32( header+4 );
+	return magic == 42 || magic == 0x4f52 || magic == 0x5352 || magic == 0x55;
+}
+
+/**
+ * Read all entries of the IFD at offset
+ * 
+ * @param next_ifd Stores the offset of the next IFD (0 for the last IFD)
+ * @return false on read errors
+ */
+inline bool tiff_read_ifd( const tiff_reader& reader, uint32_t offset,
+	std::vector< tiff_entry >& entries, uint32_t* next_ifd = nullptr ){
+	
+	uchar count[2];
+	if( offset == 0 || !reader.read( offset, count, 2 ) )
+		return false;
+	
+	std::vector< uchar > data( reader.get16( count ) * 12 + 4 );
+	if( !reader.read( offset + 2, data.data(), data.size() ) )
+		return false;
+	
+	entries.resize( data.size() / 12 );
+	for( unsigned int i = 0; i < entries.size(); i++ ){
+		const uchar* p = &data[i*12];
+		entries[i].tag = reader.get16( p );
+		entries[i].type = reader.get16( p+2 );
+		entries[i].count = reader.get32( p+4 );
+		memcpy( entries[i].value, p+8, 4 );
+	}
+	
+	if( next_ifd )
+		*next_ifd = reader.get32( &data[entries.size()*12] );
+	
+	return true;
+}
+
+/**
+ * Find the entry with the given tag
+ * 
+ * @return nullptr if the tag doesn't exist
+ */
+inline const tiff_entry* tiff_find( const std::vector< tiff_entry >& entries,
+	uint16_t tag ){
+	
+	for( auto& e : entries ){
+		if( e.tag == tag )
+			return &e;
+	}
+	return nullptr;
+}
+
+/**
+ * Get the value at index of an integer (BYTE, SHORT, LONG or IFD) entry
+ * 
+ * @return 0 on errors
+ */
+inline uint32_t tiff_value( const tiff_reader& reader, const tiff_entry& entry,
+	unsigned int index = 0 ){
+	
+	unsigned int size = entry.type == 3 ? 2 :
+		( entry.type == 4 || entry.type == 9 || entry.type == 13 ) ? 4 : 1;
+	uchar buffer[4];
+	
+	// the count is read from the file, count * size must not wrap around
+	if( index >= entry.count ){
+		return 0;
+	} else if( (uint64_t)entry.count * size <= 4 ){
+		memcpy( buffer, entry.value + index*size, size );
+	} else if( !reader.read( reader.get32( entry.value ) + (uint64_t)index*size,
+		buffer, size ) ){
+		return 0;
+	}
+	
+	return size == 1 ? buffer[0] :
+		size == 2 ? reader.get16( buffer ) : reader.get32( buffer );
+}
+
+/**
+ * Get the value of an ASCII entry
+ * 
+ * @return empty string on errors and for values longer than
+ * max_tiff_string
+ */
+inline std::string tiff_string( const tiff_reader& reader,
+	const tiff_entry& entry ){
+	
+	// the count is read from the file, corrupt entries could request
+	// gigabytes
+	if( entry.count > max_tiff_string )
+		return "";
+	
+	std::string value( entry.count, '\0' );
+	
+	if( entry.count <= 4 ){
+		memcpy( value.data(), entry.value, entry.count );
+	} else if( !reader.read( reader.get32( entry.value ), value.data(),
+		entry.count ) ){
+		return "";
+	}
+	
+	return value.substr( 0, value.find( '\0' ) );
+}
+
+/**
+ * Read the dimensions from the first IFD of a BigTIFF file, which uses
+ * 64 bit offsets and 20 byte IFD entries
+ * 
+ * @return false if the dimensions can't be read
+ */
+inline bool read_bigtiff_size( FILE* file, unsigned long& width,
+	unsigned long& height ){
+	
+	uchar header[16];
+	tiff_reader reader{ file, 0, false };
+	
+	if( !reader.read( 0, header, 16 ) )
+		return false;
+	reader.big_endian = header[0] == 'M';
+	
+	auto get64 = [&]( const uchar* p ){
+		return reader.big_endian ?
+			(uint64_t)reader.get32( p ) << 32 | reader.get32( p+4 ) :
+			(uint64_t)reader.get32( p+4 ) << 32 | reader.get32( p );
+	};
+	
+	uchar count[8];
+	uint64_t offset = get64( header+8 );
+	if( !reader.read( offset, count, 8 ) || get64( count ) > 4096 )
+		return false;
+	
+	std::vector< uchar > data( get64( count ) * 20 );
+	if( !reader.read( offset + 8, data.data(), data.size() ) )
+		return false;
+	
+	width = height = 0;
+	for( size_t i = 0; i < data.size(); i += 20 ){
+		
+		uint16_t tag = reader.get16( &data[i] );
+		uint16_t type = reader.get16( &data[i+2] );
+		unsigned long value = type == 3 ? reader.get16( &data[i+12] ) :
+			type == 4 ? reader.get32( &data[i+12] ) : get64( &data[i+12] );
+		
+		if( tag == 256 )
+			width = value;
+		else if( tag == 257 )
+			height = value;
+	}
+	
+	return width && height;
+}
+
+/**
+ * Find the EXIF data (a TIFF structure) in a JPEG, PNG or TIFF file
+ * 
+ * @return file offset of the TIFF header, -1 if there is no EXIF data
+ */
+inline long find_exif( FILE* file ){
+	
+	uchar buffer[8];
+	if( fseek( file, 0, SEEK_SET ) != 0 || fread( buffer, 1, 8, file ) != 8 )
+		return -1;
+	
+	// TIFF based files contain the EXIF tags directly
+	if( memcmp( buffer, "II*\0", 4 ) == 0 || memcmp( buffer, "MM\0*", 4 ) == 0 )
+		return 0;
+	
+	// JPEG: search the APP1 segment before the image data
+	if( buffer[0] == 0xff && buffer[1] == 0xd8 ){
+		
+		long position = 2;
+		while( fseek( file, position, SEEK_SET ) == 0 &&
+			fread( buffer, 1, 4, file ) == 4 && buffer[0] == 0xff ){
+			
+			// start of scan or end of image
+			if( buffer[1] == 0xda || buffer[1] == 0xd9 )
+				break;
+			
+			long length = buffer[2] << 8 | buffer[3];
+			if( buffer[1] == 0xe1 && length >= 8 &&
+				fread( buffer, 1, 6, file ) == 6 &&
+				memcmp( buffer, "Exif\0", 5 ) == 0 ){
+				return position + 10;
+			}
+			
+			position += 2 + length;
+		}
+		
+		return -1;
+	}
+	
+	// PNG: search the eXIf chunk before the image data
+	if( memcmp( buffer, "\x89PNG\r\n\x1a\n", 8 ) == 0 ){
+		
+		long position = 8;
+		while( fseek( file, position, SEEK_SET ) == 0 &&
+			fread( buffer, 1, 8, file ) == 8 ){
+			
+			if( memcmp( buffer+4, "eXIf", 4 ) == 0 )
+				return position + 8;
+			if( memcmp( buffer+4, "IDAT", 4 ) == 0 )
+				break;
+			
+			long length = (long)buffer[0] << 24 | buffer[1] << 16 |
+				buffer[2] << 8 | buffer[3];
+			position += 12 + length;
+		}
+	}
+	
+	return -1;
+}
+
+/**
+ * Read the capture time (EXIF DateTimeOriginal) of an image, only the
+ * file header is read
+ * 
+ * @return seconds since the epoch, no_timestamp if the image has no
+ * capture time
+ */
+inline long long read_exif_timestamp( FILE* file ){
+	
+	long long timestamp = no_timestamp;
+	std::vector< tiff_entry > entries;
+	tiff_reader reader;
+	uint32_t ifd;
+	
+	long base = find_exif( file );
+	if( base >= 0 && tiff_open( file, base, reader, ifd ) &&
+		tiff_read_ifd( reader, ifd, entries ) ){
+		
+		// DateTimeOriginal is stored in the EXIF IFD
+		const tiff_entry* exif_ifd = tiff_find( entries, 0x8769 );
+		if( exif_ifd && tiff_read_ifd( reader, tiff_value( reader, *exif_ifd ),
+			entries ) ){
+			
+			const tiff_entry* date = tiff_find( entries, 0x9003 );
+			std::tm time = {};
+			
+			if( date && sscanf( tiff_string( reader, *date ).c_str(),
+				"%d:%d:%d %d:%d:%d", &time.tm_year, &time.tm_mon,
+				&time.tm_mday, &time.tm_hour, &time.tm_min,
+				&time.tm_sec ) == 6 && time.tm_year > 0 ){
+				
+				time.tm_year -= 1900;
+				time.tm_mon -= 1;
+				timestamp = timegm( &time );
+			}
+		}
+	}
+	
+	return timestamp;
+}
+
+/**
+ * Read the capture time (EXIF DateTimeOriginal) of an image file
+ * 
+ * @return no_timestamp if the file can't be opened or has no capture time
+ */
+inline long long read_exif_timestamp( const std::string& filename ){
+	
+	FILE* file = fopen( filename.c_str(), "rb" );
+	if( !file )
+		return no_timestamp;
+	
+	long long timestamp = read_exif_timestamp( file );
+	fclose( file );
+	return timestamp;
+}
+
+/**
+ * Image formats recognized by read_image_header
+ */
+enum image_format{
+	format_unknown, format_jpeg, format_png, format_gif, format_bmp,
+	format_webp, format_tiff, format_raw, format_heif
+};
+
+/**
+ * Information from the header of an image file
+ */
+struct image_header{
+	image_format format = format_unknown;
+	unsigned long width = 0, height = 0;
+	unsigned int orientation = 1; // EXIF orientation (1-8)
+	bool progressive = false; // interlaced PNG or progressive JPEG
+	unsigned long preview_offset = 0, preview_length = 0; // JPEG in RAW images
+};
+
+/**
+ * Read the dimensions from the start of frame segment of a JPEG image
+ * that starts at offset start in file
+ * 
+ * @param sof Stores the start of frame marker, if not nullptr
+ * @return false if there is no start of frame segment
+ */
+inline bool read_jpeg_header( FILE* file, long start, image_header& header,
+	uchar* sof = nullptr ){
+	
+	uchar buffer[9];
+	auto be16 = [&]( int i ){ return (unsigned long)buffer[i] << 8 | buffer[i+1]; };
+	
+	if( fseek( file, start, SEEK_SET ) != 0 || fread( buffer, 1, 2, file ) != 2 ||
+		buffer[0] != 0xff || buffer[1] != 0xd8 ){
+		return false;
+	}
+	
+	// search the start of frame segment
+	long position = start + 2;
+	while( fseek( file, position, SEEK_SET ) == 0 &&
+		fread( buffer, 1, 9, file ) == 9 && buffer[0] == 0xff ){
+		
+		uchar marker = buffer[1];
+		if( marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 &&
+			marker != 0xc8 && marker != 0xcc ){
+			
+			header.format = format_jpeg;
+			header.height = be16( 5 );
+			header.width = be16( 7 );
+			header.progressive = marker == 0xc2 || marker == 0xc6 ||
+				marker == 0xca || marker == 0xce;
+			if( sof )
+				*sof = marker;
+			return true;
+		}
+		
+		if( marker == 0xda || marker == 0xd9 )
+			return false;
+		
+		position += 2 + be16( 2 );
+	}
+	
+	return false;
+}
+
+/**
+ * Search the boxes between begin and end of a HEIF or AVIF file for the
+ * image spatial extents (ispe) and the rotation (irot) properties. The
+ * largest extents belong to the primary image, smaller ones to its tiles
+ * or thumbnails.
+ * 
+ * @param rotated Set if an image is rotated by 90 or 270 degrees
+ */
+inline void read_heif_boxes( FILE* file, long begin, long end,
+	unsigned long& width, unsigned long& height, bool& rotated, int depth = 0 ){
+	
+	uchar box[20];
+	auto be32 = [&]( int i ){
+		return (unsigned long)box[i] << 24 | box[i+1] << 16 | box[i+2] << 8 | box[i+3];
+	};
+	
+	for( long position = begin; position + 8 <= end; ){
+		
+		memset( box, 0, sizeof(box) );
+		if( fseek( file, position, SEEK_SET ) != 0 || fread( box, 1, 20, file ) < 9 )
+			return;
+		
+		// the size includes the header, 0 extends to the end
+		long size = be32( 0 );
+		if( size == 0 )
+			size = end - position;
+		if( size < 8 )
+			return;
+		
+		if( memcmp( box+4, "ispe", 4 ) == 0 && size >= 20 ){
+			// full box with version and flags before the extents
+			if( be32( 12 ) * be32( 16 ) > width * height ){
+				width = be32( 12 );
+				height = be32( 16 );
+			}
+		} else if( memcmp( box+4, "irot", 4 ) == 0 ){
+			rotated = box[8] & 1;
+		} else if( depth < 3 && memcmp( box+4, "meta", 4 ) == 0 ){
+			read_heif_boxes( file, position + 12, position + size, width, height,
+				rotated, depth + 1 );
+		} else if( depth < 3 && ( memcmp( box+4, "iprp", 4 ) == 0 ||
+			memcmp( box+4, "ipco", 4 ) == 0 ) ){
+			read_heif_boxes( file, position + 8, position + size, width, height,
+				rotated, depth + 1 );
+		}
+		
+		position += size;
+	}
+}
+
+/**
+ * Read the dimensions and the format of an image without decoding it
+ * 
+ * @return false if the format is not recognized
+ */
+inline bool read_image_header( FILE* file, image_header& header ){
+	
+	uchar buffer[32];
+	if( fseek( file, 0, SEEK_SET ) != 0 || fread( buffer, 1, 32, file ) != 32 )
+		return false;
+	
+	// readers for big and little endian integers in buffer
+	auto be16 = [&]( int i ){ return (unsigned long)buffer[i] << 8 | buffer[i+1]; };
+	auto be32 = [&]( int i ){ return be16(i) << 16 | be16(i+2); };
+	auto le16 = [&]( int i ){ return (unsigned long)buffer[i+1] << 8 | buffer[i]; };
+	auto le32 = [&]( int i ){ return le16(i+2) << 16 | le16(i); };
+	
+	tiff_reader reader;
+	uint32_t ifd;
+	std::vector< tiff_entry > entries;
+	
+	if( memcmp( buffer, "\x89PNG\r\n\x1a\n", 8 ) == 0 &&
+		memcmp( buffer+12, "IHDR", 4 ) == 0 ){
+		
+		header.format = format_png;
+		header.width = be32( 16 );
+		header.height = be32( 20 );
+		header.progressive = buffer[28] == 1;
+		
+	} else if( buffer[0] == 0xff && buffer[1] == 0xd8 ){
+		
+		if( !read_jpeg_header( file, 0, header ) )
+			return false;
+		
+	} else if( memcmp( buffer, "GIF8", 4 ) == 0 ){
+		
+		header.format = format_gif;
+		header.width = le16( 6 );
+		header.height = le16( 8 );
+		
+	} else if( memcmp( buffer, "BM", 2 ) == 0 ){
+		
+		header.format = format_bmp;
+		header.width = le32( 18 );
+		header.height = le32( 22 );
+		
+		// negative height for top-down bitmaps
+		if( header.height & 0x80000000 )
+			header.height = 0x100000000 - header.height;
+		
+	} else if( memcmp( buffer, "RIFF", 4 ) == 0 &&
+		memcmp( buffer+8, "WEBP", 4 ) == 0 ){
+		
+		header.format = format_webp;
+		
+		if( memcmp( buffer+12, "VP8X", 4 ) == 0 ){ // extended format
+			header.width = ( le32( 24 ) & 0xffffff ) + 1;
+			header.height = ( le32( 27 ) & 0xffffff ) + 1;
+		} else if( memcmp( buffer+12, "VP8 ", 4 ) == 0 ){ // lossy
+			header.width = le16( 26 ) & 0x3fff;
+			header.height = le16( 28 ) & 0x3fff;
+		} else if( memcmp( buffer+12, "VP8L", 4 ) == 0 ){ // lossless
+			header.width = ( le32( 21 ) & 0x3fff ) + 1;
+			header.height = ( ( le32( 21 ) >> 14 ) & 0x3fff ) + 1;
+		}
+		
+	} else if( memcmp( buffer+4, "ftyp", 4 ) == 0 && ( memcmp( buffer+8, "hei", 3 ) == 0 ||
+		memcmp( buffer+8, "hev", 3 ) == 0 || memcmp( buffer+8, "mif1", 4 ) == 0 ||
+		memcmp( buffer+8, "msf1", 4 ) == 0 || memcmp( buffer+8, "avi", 3 ) == 0 ) ){
+		
+		bool rotated = false;
+		header.format = format_heif;
+		read_heif_boxes( file, 0, LONG_MAX, header.width, header.height, rotated );
+		if( rotated )
+			std::swap( header.width, header.height );
+		
+	} else if( memcmp( buffer, "II\x2b\0\x08\0\0\0", 8 ) == 0 ||
+		memcmp( buffer, "MM\0\x2b\0\x08\0\0", 8 ) == 0 ){
+		
+		if( read_bigtiff_size( file, header.width, header.height ) )
+			header.format = format_tiff;
+		
+	} else if( tiff_open( file, 0, reader, ifd ) &&
+		tiff_read_ifd( reader, ifd, entries ) ){
+		
+		const tiff_entry* width = tiff_find( entries, 256 );
+		const tiff_entry* height = tiff_find( entries, 257 );
+		
+		if( width && height ){
+			header.format = format_tiff;
+			header.width = tiff_value( reader, *width );
+			header.height = tiff_value( reader, *height );
+		}
+	}
+	
+	// orientation from the EXIF data
+	long base = find_exif( file );
+	if( base >= 0 && tiff_open( file, base, reader, ifd ) &&
+		tiff_read_ifd( reader, ifd, entries ) ){
+		
+		const tiff_entry* orientation = tiff_find( entries, 0x112 );
+		if( orientation && tiff_value( reader, *orientation ) >= 1 &&
+			tiff_value( reader, *orientation ) <= 8 ){
+			header.orientation = tiff_value( reader, *orientation );
+		}
+	}
+	
+	return header.format != format_unknown && header.width && header.height;
+}
+
+/**
+ * Check the file extension for a TIFF based camera RAW format
+ */
+inline bool is_raw_file( const std::string& filename ){
+	
+	std::string extension = std::filesystem::path( filename ).extension();
+	std::transform( extension.begin(), extension.end(), extension.begin(),
+		[]( unsigned char c ){ return std::tolower( c ); } );
+	
+	for( const char* raw : { ".cr2", ".nef", ".nrw", ".arw", ".dng", ".orf",
+		".rw2", ".pef", ".srw" } ){
+		
+		if( extension == raw )
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Find the largest embedded JPEG preview of a TIFF based RAW image. The
+ * previews are searched in all IFDs and SubIFDs, either as JPEG
+ * interchange format or as a single JPEG compressed strip. Lossless JPEG
+ * streams contain the raw sensor data and are ignored.
+ * 
+ * @param header Stores the dimensions and the location of the preview
+ * @return false if there is no preview
+ */
+inline bool read_raw_header( FILE* file, image_header& header ){
+	
+	tiff_reader reader;
+	uint32_t first_ifd;
+	if( !tiff_open( file, 0, reader, first_ifd ) )
+		return false;
+	
+	// the IFDs and SubIFDs are visited in order, limited against loops
+	std::vector< uint32_t > ifds = { first_ifd };
+	const unsigned int max_ifds = 64;
+	
+	auto check_preview = [&]( uint32_t offset, uint32_t length ){
+		
+		image_header preview;
+		uchar sof;
+		if( length == 0 || !read_jpeg_header( file, offset, preview, &sof ) ||
+			sof == 0xc3 || sof == 0xc7 || sof == 0xcb || sof == 0xcf ){
+			return;
+		}
+		
+		if( preview.width * preview.height > header.width * header.height ||
+			header.format != format_raw ){
+			
+			header.format = format_raw;
+			header.width = preview.width;
+			header.height = preview.height;
+			header.progressive = preview.progressive;
+			header.preview_offset = offset;
+			header.preview_length = length;
+		}
+	};
+	
+	for( unsigned int n = 0; n < ifds.size(); n++ ){
+		
+		std::vector< tiff_entry > entries;
+		uint32_t next = 0;
+		if( !tiff_read_ifd( reader, ifds.at(n), entries, &next ) )
+			continue;
+		
+		if( next && ifds.size() < max_ifds )
+			ifds.push_back( next );
+		
+		// SubIFDs are LONG or IFD offsets, the list ends at the first
+		// offset that can't be read
+		const tiff_entry* subifds = tiff_find( entries, 0x14a );
+		if( subifds && subifds->type != 4 && subifds->type != 13 )
+			subifds = nullptr;
+		
+		for( uint32_t i = 0; subifds && i < subifds->count &&
+			ifds.size() < max_ifds; i++ ){
+			
+			uint32_t subifd = tiff_value( reader, *subifds, i );
+			if( subifd == 0 )
+				break;
+			ifds.push_back( subifd );
+		}
+		
+		// JPEGInterchangeFormat or a single strip with (old) JPEG compression
+		const tiff_entry* offset = tiff_find( entries, 0x201 );
+		const tiff_entry* length = tiff_find( entries, 0x202 );
+		const tiff_entry* compression = tiff_find( entries, 0x103 );
+		
+		if( ( !offset || !length ) && compression &&
+			( tiff_value( reader, *compression ) == 6 ||
+			tiff_value( reader, *compression ) == 7 ) ){
+			
+			offset = tiff_find( entries, 0x111 );
+			length = tiff_find( entries, 0x117 );
+			if( offset && offset->count != 1 )
+				offset = nullptr;
+		}
+		
+		if( offset && length ){
+			check_preview( tiff_value( reader, *offset ),
+				tiff_value( reader, *length ) );
+		}
+		
+		// Panasonic stores the preview as JpgFromRaw
+		const tiff_entry* jpeg = tiff_find( entries, 0x2e );
+		if( jpeg && jpeg->count > 4 )
+			check_preview( reader.get32( jpeg->value ), jpeg->count );
+	}
+	
+	return header.format == format_raw;
+}
+
+/**
+ * Read the dimensions and the format of an image without decoding it
+ * 
+ * @return false if the file can't be opened or the format is not recognized
+ */
+inline bool read_image_header( const std::string& filename,
+	image_header& header ){
+	
+	FILE* file = fopen( filename.c_str(), "rb" );
+	if( !file )
+		return false;
+	
+	bool result = read_image_header( file, header );
+	
+	// RAW images are decoded from their embedded preview
+	if( is_raw_file( filename ) ){
+		result = read_raw_header( file, header );
+		if( !result )
+			header.format = format_unknown;
+	}
+	
+	fclose( file );
+	return result;
+}
+
+/**
+ * Get the aspect ratio bucket of an image, images with similar aspect
+ * ratios (after applying the EXIF orientation) are in the same or in
+ * neighbouring buckets
+ */
+inline long aspect_bucket( const image_header& header ){
+	
+	double aspect = (double)header.width / header.height;
+	
+	// orientations 5-8 swap width and height
+	if( header.orientation >= 5 )
+		aspect = 1 / aspect;
+	
+	return std::floor( std::log( aspect ) / aspect_bucket_width );
+}
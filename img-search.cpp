@@ -40,6 +40,8 @@
 #include <algorithm>
 #include <exception>
 #include <cstring>
+#include <cstdio>
+#include <cmath>
 #include <unistd.h>
 
 #include "opencv2/core.hpp"
@@ -48,6 +50,8 @@
 #include "opencv2/img_hash.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 
+#include "image-header.hpp"
+
 /**
  * Prints the help message
  */
@@ -55,26 +59,49 @@ void print_help(){
 	std::cout << "img-search usage:\n\n";
 	std::cout << "img-search [files...]\n";
 	std::cout << "img-search -t [threshold] [files...]\n";
+	std::cout << "img-search -b [-t threshold] [files...]\n";
 	std::cout << "img-search -h\n\n";
 	std::cout << "The filenames for comparison are read from stdin.\n";
+	std::cout << "-b reads the image headers first and skips images whose\n";
+	std::cout << "aspect ratio differs from all searched images.\n";
 	
 }
 
 // Mutex for the calculate_hash_values function
 std::mutex mu;
 
+/**
+ * Get the aspect ratio bucket of an image from the file header, images
+ * with similar aspect ratios are in the same or in neighbouring buckets.
+ * 
+ * @param bucket Stores the bucket
+ * @return false if the format is not recognized
+ */
+bool read_aspect_bucket( const std::string& filename, long& bucket ){
+	
+	image_header header;
+	if( !read_image_header( filename, header ) )
+		return false;
+	
+	bucket = aspect_bucket( header );
+	return true;
+}
+
 /**
  * Calculate the perceptual hash of the images
  * 
  * @param file_list List of filenames for all images
  * @param hash_list Stores the hash values
  * @param hash_func Hash function
+ * @param buckets Only images in these aspect ratio buckets are hashed,
+ * if not empty
  * @param thread_id Number of the particular thread
  * @param num_threads Total number of threads
  */
 void calculate_hash_values( const std::deque<std::string>& file_list, 
 	std::map<unsigned long, cv::Mat>& hash_list, 
 	cv::Ptr<cv::img_hash::ImgHashBase> hash_func, 
+	const std::set<long>& buckets,
 	unsigned int thread_id, unsigned int num_threads ){
 	
 	// iterate over file_list
@@ -84,6 +111,12 @@ void calculate_hash_values( const std::deque<std::string>& file_list,
 		if( i%num_threads != thread_id )
 			continue;
 		
+		// skip images with a different aspect ratio, without decoding
+		long bucket;
+		if( !buckets.empty() && read_aspect_bucket( file_list.at(i), bucket ) &&
+			buckets.count( bucket ) == 0 )
+			continue;
+		
 		// read image
 		cv::Mat current_image = cv::imread( file_list.at(i) );
 		
@@ -129,17 +162,24 @@ int main( int argc, char* argv[] ){
 		return 0;
 	}
 	
+	// skip images with different aspect ratios
+	bool use_blocking = false;
+	if( argc >= 2 && strcmp(argv[skip_argv], "-b") == 0 ){
+		use_blocking = true;
+		skip_argv++;
+	}
+	
 	// this is the threshold under which images are considered similar
 	double threshold = 2.0;
-	if( argc >= 3 && ( strcmp(argv[1], "-t") == 0 ) ){
+	if( argc >= skip_argv + 2 && ( strcmp(argv[skip_argv], "-t") == 0 ) ){
 		
 		try{
-			threshold = stod( argv[2] );
+			threshold = stod( argv[skip_argv + 1] );
 		} catch( exception &e ){
 			cerr << "Exception caught: " << e.what() << "\n";
 		}
 		
-		skip_argv = 3;
+		skip_argv += 2;
 	}
 	
 	// get list of filenames to search for and calculate their hashes
@@ -150,7 +190,23 @@ int main( int argc, char* argv[] ){
 	
 	map<unsigned long, cv::Mat> search_hash_values;
 	calculate_hash_values( search_list, search_hash_values,
-		cv::img_hash::PHash::create(), 0, 1 );
+		cv::img_hash::PHash::create(), set<long>(), 0, 1 );
+	
+	// Aspect ratio buckets of the searched images (after applying the EXIF
+	// orientation, as cv::imread does), including the neighbouring
+	// buckets. Images with unrecognized headers disable the blocking.
+	set<long> buckets;
+	for( unsigned long i = 0; use_blocking && i < search_list.size(); i++ ){
+		
+		long bucket;
+		if( !read_aspect_bucket( search_list.at(i), bucket ) ){
+			buckets.clear();
+			break;
+		}
+		
+		for( long b = bucket - 1; b <= bucket + 1; b++ )
+			buckets.insert( b );
+	}
 	
 	// get list of filenames to search in
 	//******************************************************************
@@ -179,7 +235,7 @@ int main( int argc, char* argv[] ){
     for( unsigned int i = 0; i < num_threads; ++i ){
 		t[i] = thread( calculate_hash_values, ref(file_list), 
 		ref(img_hash_values), cv::img_hash::PHash::create(), 
-		i, num_threads );
+		ref(buckets), i, num_threads );
 	}
     
     // join threads
@@ -34,18 +34,70 @@
 #include <set>
 #include <vector>
 #include <string>
+#include <sstream>
 #include <filesystem>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <algorithm>
 #include <exception>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <cmath>
+#include <climits>
+#include <unordered_map>
+#include <unordered_set>
+#include <string_view>
+#include <span>
+#include <functional>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <spawn.h>
+#include <poll.h>
+#include <csignal>
+#include <chrono>
 
 #include "opencv2/core.hpp"
 #include "opencv2/core/ocl.hpp"
 #include <opencv2/imgcodecs.hpp>
 #include "opencv2/img_hash.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
+#include <opencv2/videoio.hpp>
+
+#include "image-header.hpp"
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
+#ifdef HAVE_LIBTIFF
+#include <tiffio.h>
+#endif
+
+#ifdef HAVE_LIBJPEG
+#include <csetjmp>
+#include <jpeglib.h>
+#endif
+
+#ifdef HAVE_LIBWEBP
+#include <webp/decode.h>
+#endif
+
+#ifdef HAVE_LIBHEIF
+#include <libheif/heif.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 /**
  * Prints the help message
@@ -55,121 +107,3811 @@
 	printf("img-similarity-cluster usage:\n\n"); \
 	printf("-h\tshow this message\n"); \
 	printf("-d=arg\tdirectory of images (- for stdin)\n"); \
+	printf("-q=arg\tdirectory of query images (- for stdin), only compare\n"); \
+	printf("\tthese against the images from -d\n"); \
 	printf("-r\tload images recursively\n"); \
 	printf("-t=arg\tthreshold for similarity\n"); \
+	printf("-a=arg\tcomma separated list of descriptors, images are similar\n"); \
+	printf("\tif they are similar according to all descriptors:\n"); \
+	printf("\tphash, average, blockmean, marrhildreth, colormoment\n"); \
+	printf("\tname:threshold sets the threshold of a descriptor (default: phash)\n"); \
+	printf("-s=arg\tthumbnail store, unchanged images are hashed from their\n"); \
+	printf("\tthumbnails instead of being decoded again (not with\n"); \
+	printf("\tblockmean and marrhildreth), thumbnails of images from\n"); \
+	printf("\tother runs are kept until the store is deleted\n"); \
+	printf("-c\tstore colour thumbnails (required for colormoment with -s)\n"); \
+	printf("-u\twith -s, don't list directories again that are unchanged\n"); \
+	printf("\tsince the last run, their files are assumed to be unchanged\n"); \
+	printf("-x\tdecode all images at the full resolution\n"); \
+	printf("\t(images are reduced to 8 times the descriptor input size\n"); \
+	printf("\tbefore hashing, so the hashes differ slightly from hashing\n"); \
+	printf("\tthe full image)\n"); \
+	printf("-M=arg\tmemory budget for decoded images and archive members in\n"); \
+	printf("\tMB, larger images are decoded with a reduced resolution\n"); \
+	printf("-P=arg\tskip images with more than arg megapixels\n"); \
+	printf("-T=arg\tskip images that take longer than arg seconds to decode,\n"); \
+	printf("\tthe images are decoded in a worker process per thread that\n"); \
+	printf("\tis restarted after a timeout or crash (multi-frame\n"); \
+	printf("\timages with -n and videos are decoded without time limit)\n"); \
+	printf("-o=arg\tavoid filling the page cache with the images:\n"); \
+	printf("\tdontneed drops each image after hashing and prefetches the\n"); \
+	printf("\tnext ones, direct reads the images with O_DIRECT\n"); \
+	printf("-B=arg\tread at most arg MB per second\n"); \
+	printf("-F=arg\topen at most arg images per second\n"); \
+	printf("-e\trun with idle I/O priority and the lowest CPU priority\n"); \
+	printf("-S\thash the largest images first, so that no large image is\n"); \
+	printf("\tleft for the end\n"); \
+	printf("-w=arg\tonly compare images whose EXIF capture times differ by at\n"); \
+	printf("\tmost arg seconds, images without capture time are compared\n"); \
+	printf("\tto all images\n"); \
+	printf("-g=arg\tcrop tolerant matching, images are similar if arg regions\n"); \
+	printf("\tmatch, arg:threshold sets the region threshold (default: 4)\n"); \
+	printf("-n=arg\thash several frames of animated GIF and multi-page TIFF\n"); \
+	printf("\timages, images are similar if any frames are similar:\n"); \
+	printf("\tN for the first N frames, sN for N evenly spaced frames,\n"); \
+	printf("\t0 for all frames (default: 1)\n"); \
+	printf("-v=arg\thash video files (mp4, mov, mkv, webm, avi, ...) from one\n"); \
+	printf("\tframe every arg seconds, videos and images are similar if\n"); \
+	printf("\tany frames are similar\n"); \
+	printf("-z\talso read the images in zip, tar and tar.gz archives, they\n"); \
+	printf("\tare printed as archive!/path (the archives are listed by\n"); \
+	printf("\tone thread, tar.gz archives are decompressed for listing;\n"); \
+	printf("\tmembers are not filtered by -b, not stored with -s and\n"); \
+	printf("\thashed from their first frame only, without -n and -v)\n"); \
+	printf("-i\talso find rotated and flipped images (phash descriptor)\n"); \
+	printf("-b\tread the image headers first and skip images without\n"); \
+	printf("\tanother image of a similar aspect ratio\n"); \
 	printf("-l\tprint all similar images on one line and nothing else\n");
 
 
 // Mutex for the calculate_hash_values function
 std::mutex mu;
 
+// Bucket of images whose header can't be read
+const long no_bucket = LONG_MIN;
+
+// Reserved from the memory budget for images with an unrecognized header
+// (a 24 megapixel image)
+const unsigned long long unknown_decoded_bytes = 6000ULL * 4000 * 3;
+
+// Images are reduced to this multiple of the input size of the descriptors
+const int input_size_factor = 8;
+
+// Side length of the thumbnails in the thumbnail store
+const int thumbnail_size = 64;
+
+// Images with more pixels are decoded row by row (PNG, TIFF)
+const unsigned long streaming_min_pixels = 4096 * 4096;
+
+// Largest TIFF strip that is converted to RGBA at once (pixels)
+const unsigned long streaming_max_strip_pixels = 1 << 20;
+
+// Number of hashed regions per image for crop tolerant matching
+const unsigned int num_regions = 19;
+
+// Size the images are reduced to before the regions are hashed
+const int region_input_size = 160;
+
+// Regions with a lower standard deviation are not indexed
+const double region_min_stddev = 4.0;
+
+// Largest number of hashed frames per video
+const size_t max_video_frames = 100;
+
+// Separates the archive and the path of archive members in the filenames
+const std::string archive_separator = "!/";
+
+// Larger archive members are skipped (bytes)
+const uint64_t max_member_size = 256ULL << 20;
+
+// Number of following files of a thread that are prefetched with -o
+const unsigned int prefetch_files = 2;
+
+// Size and alignment of the O_DIRECT reads, larger files are read normally
+const size_t direct_chunk_size = 1 << 20;
+const size_t direct_alignment = 4096;
+const off_t max_direct_size = 256 << 20;
+
 /**
- * Calculate the perceptual hash of the images
+ * Read the image headers and get the aspect ratio bucket of each image
  * 
  * @param file_list List of filenames for all images
- * @param hash_list Stores the hash values
+ * @param buckets Stores the buckets, no_bucket for unrecognized images
  * @param thread_id Number of the particular thread
  * @param num_threads Total number of threads
  */
-void calculate_hash_values( const std::deque<std::string>& file_list, 
-	std::vector< cv::Mat >& hash_list,
+void calculate_aspect_buckets( const std::deque<std::string>& file_list,
+	std::vector< long >& buckets,
 	unsigned int thread_id, unsigned int num_threads ){
-
-	cv::Ptr<cv::img_hash::ImgHashBase> hash_func = cv::img_hash::PHash::create();
 	
-	// iterate over file_list
 	for( unsigned long i = 0; i < file_list.size(); i++ ){
 		
 		// check if correct thread for image
 		if( i%num_threads != thread_id )
 			continue;
 		
-		cv::Mat current_image, current_hash;
+		image_header header;
+		buckets.at(i) = read_image_header( file_list.at(i), header ) ?
+			aspect_bucket( header ) : no_bucket;
+	}
+}
+
+/**
+ * A descriptor (img_hash algorithm) and its similarity threshold
+ */
+struct descriptor{
+	std::string name;
+	double threshold;
+};
+
+// Names of the supported descriptors and their default thresholds
+const std::map< std::string, double > descriptor_thresholds = {
+	{ "phash", 0.2 }, { "average", 0.2 }, { "blockmean", 0.2 },
+	{ "marrhildreth", 0.2 }, { "colormoment", 1.0 }
+};
+
+/**
+ * Parse a comma separated list of descriptors (name or name:threshold)
+ * 
+ * @param threshold Threshold for descriptors without explicit threshold,
+ * nullptr for the default threshold of each descriptor
+ * @return false if a descriptor is unknown
+ */
+bool parse_descriptors( const std::string& arg, const double* threshold,
+	std::vector< descriptor >& descriptors ){
+	
+	std::stringstream arg_stream( arg );
+	std::string item;
+	
+	while( std::getline( arg_stream, item, ',' ) ){
+		
+		descriptor d;
+		d.name = item.substr( 0, item.find( ':' ) );
 		
-		// read image
-		current_image = cv::imread( file_list.at(i) );
+		if( !descriptor_thresholds.contains( d.name ) )
+			return false;
 		
-		// check for image data
-		if( !current_image.data ){
-			hash_list.at(i) = current_image;
+		if( item.find( ':' ) != std::string::npos ){
+			try{
+				d.threshold = std::stod( item.substr( item.find( ':' ) + 1 ) );
+			} catch( std::exception &e ){
+				return false;
+			}
+		} else{
+			d.threshold = threshold ? *threshold :
+				descriptor_thresholds.at( d.name );
+		}
+		
+		descriptors.push_back( d );
+	}
+	
+	return !descriptors.empty();
+}
+
+/**
+ * Create the hash functions of the descriptors (one set per thread)
+ */
+std::vector< cv::Ptr<cv::img_hash::ImgHashBase> > create_hash_funcs(
+	const std::vector< descriptor >& descriptors ){
+	
+	std::vector< cv::Ptr<cv::img_hash::ImgHashBase> > hash_funcs;
+	
+	for( auto& d : descriptors ){
+		if( d.name == "average" ){
+			hash_funcs.push_back( cv::img_hash::AverageHash::create() );
+		} else if( d.name == "blockmean" ){
+			hash_funcs.push_back( cv::img_hash::BlockMeanHash::create() );
+		} else if( d.name == "marrhildreth" ){
+			hash_funcs.push_back( cv::img_hash::MarrHildrethHash::create() );
+		} else if( d.name == "colormoment" ){
+			hash_funcs.push_back( cv::img_hash::ColorMomentHash::create() );
+		} else{
+			hash_funcs.push_back( cv::img_hash::PHash::create() );
+		}
+	}
+	
+	return hash_funcs;
+}
+
+/**
+ * Get the size that larger images are reduced to once before hashing.
+ * It is input_size_factor times the size that the descriptors resize
+ * their input to, so that their own resizing still decides the hash.
+ */
+int descriptor_input_size( const std::vector< descriptor >& descriptors ){
+	
+	int size = 0;
+	
+	for( auto& d : descriptors ){
+		if( d.name == "phash" ){
+			size = std::max( size, 32 );
+		} else if( d.name == "average" ){
+			size = std::max( size, 8 );
+		} else if( d.name == "blockmean" ){
+			size = std::max( size, 256 );
+		} else{
+			size = std::max( size, 512 );
+		}
+	}
+	
+	return size * input_size_factor;
+}
+
+/**
+ * Reduces an image to size x size pixels by averaging the rows while
+ * they are decoded, the memory doesn't depend on the image size
+ */
+struct area_accumulator{
+	
+	int width = 0, height = 0, size = 0;
+	std::vector< uint64_t > sums; // size*size BGR sums, exact for any image size
+	std::vector< int > column_bins; // output column of each input column
+	
+	/**
+	 * @param image_width, image_height Size of the decoded image, at
+	 * least output_size
+	 */
+	void init( int image_width, int image_height, int output_size ){
+		
+		width = image_width;
+		height = image_height;
+		size = output_size;
+		sums.assign( size * size * 3, 0 );
+		
+		column_bins.resize( width );
+		for( int x = 0; x < width; x++ )
+			column_bins.at(x) = (long)x * size / width;
+	}
+	
+	/**
+	 * Add a part of row y, starting at column x0
+	 * 
+	 * @param pixels Pixel data
+	 * @param step Bytes per pixel
+	 * @param b, g, r Offsets of the colour channels in a pixel
+	 */
+	void add_row( int y, int x0, int count, const uchar* pixels, int step,
+		int b, int g, int r ){
+		
+		uint64_t* bins = &sums.at( (long)y * size / height * size * 3 );
+		
+		for( int x = 0; x < count; x++ ){
+			uint64_t* bin = bins + column_bins.at( x0 + x ) * 3;
+			bin[0] += pixels[b];
+			bin[1] += pixels[g];
+			bin[2] += pixels[r];
+			pixels += step;
+		}
+	}
+	
+	/**
+	 * Get the reduced BGR image
+	 */
+	cv::Mat result() const{
+		
+		cv::Mat image( size, size, CV_8UC3 );
+		
+		for( int oy = 0; oy < size; oy++ ){
+			
+			// number of input rows in this output row
+			long rows = ( (long)( oy+1 ) * height + size - 1 ) / size -
+				( (long)oy * height + size - 1 ) / size;
+			
+			for( int ox = 0; ox < size; ox++ ){
+				
+				long columns = ( (long)( ox+1 ) * width + size - 1 ) / size -
+					( (long)ox * width + size - 1 ) / size;
+				const uint64_t* bin = &sums.at( ( oy * size + ox ) * 3 );
+				uint64_t pixels = rows * columns;
+				
+				for( int c = 0; c < 3; c++ ){
+					image.ptr<uchar>( oy )[ ox*3 + c ] =
+						std::min< uint64_t >( 255, ( bin[c] + pixels / 2 ) / pixels );
+				}
+			}
+		}
+		
+		return image;
+	}
+};
+
+#ifdef HAVE_LIBPNG
+/**
+ * Buffers of the PNG decoders, they are owned by the caller of the
+ * function that calls setjmp, because its local variables that are
+ * modified after setjmp are indeterminate after a longjmp
+ */
+struct png_buffers{
+	area_accumulator accumulator;
+	std::vector< uchar > row;
+	cv::Mat image;
+};
+
+/**
+ * Read a non-interlaced PNG image row by row into buffers.accumulator
+ * 
+ * @return false if the image can't be decoded this way
+ */
+bool read_png_streaming( FILE* file, int size, png_buffers& buffers ){
+	
+	png_structp png = png_create_read_struct( PNG_LIBPNG_VER_STRING,
+		nullptr, nullptr, nullptr );
+	png_infop info = png ? png_create_info_struct( png ) : nullptr;
+	
+	if( !info || fseek( file, 0, SEEK_SET ) != 0 ){
+		png_destroy_read_struct( &png, nullptr, nullptr );
+		return false;
+	}
+	
+	// libpng reports errors with longjmp
+	if( setjmp( png_jmpbuf( png ) ) ){
+		png_destroy_read_struct( &png, &info, nullptr );
+		return false;
+	}
+	
+	png_init_io( png, file );
+	png_read_info( png, info );
+	
+	int width = png_get_image_width( png, info );
+	int height = png_get_image_height( png, info );
+	
+	if( png_get_interlace_type( png, info ) != PNG_INTERLACE_NONE ||
+		width < size || height < size ){
+		png_destroy_read_struct( &png, &info, nullptr );
+		return false;
+	}
+	
+	// convert everything to 8 bit BGR
+	png_set_expand( png );
+	png_set_strip_16( png );
+	png_set_strip_alpha( png );
+	png_set_gray_to_rgb( png );
+	png_set_bgr( png );
+	png_read_update_info( png, info );
+	
+	buffers.row.resize( png_get_rowbytes( png, info ) );
+	buffers.accumulator.init( width, height, size );
+	
+	for( int y = 0; y < height; y++ ){
+		png_read_row( png, buffers.row.data(), nullptr );
+		buffers.accumulator.add_row( y, 0, width, buffers.row.data(), 3, 0, 1, 2 );
+	}
+	
+	png_destroy_read_struct( &png, &info, nullptr );
+	return true;
+}
+
+/**
+ * Decode a non-interlaced PNG image row by row and reduce it to
+ * size x size pixels
+ * 
+ * @return empty Mat if the image can't be decoded this way
+ */
+cv::Mat decode_png_streaming( FILE* file, int size ){
+	
+	png_buffers buffers;
+	
+	if( !read_png_streaming( file, size, buffers ) )
+		return cv::Mat();
+	
+	return buffers.accumulator.result();
+}
+
+/**
+ * Read the first Adam7 passes of an interlaced PNG image into
+ * buffers.image, see decode_png_interlaced
+ * 
+ * @return false if the image can't be decoded this way
+ */
+bool read_png_interlaced( FILE* file, int size, png_buffers& buffers ){
+	
+	png_structp png = png_create_read_struct( PNG_LIBPNG_VER_STRING,
+		nullptr, nullptr, nullptr );
+	png_infop info = png ? png_create_info_struct( png ) : nullptr;
+	
+	if( !info || fseek( file, 0, SEEK_SET ) != 0 ){
+		png_destroy_read_struct( &png, nullptr, nullptr );
+		return false;
+	}
+	
+	// libpng reports errors with longjmp
+	if( setjmp( png_jmpbuf( png ) ) ){
+		png_destroy_read_struct( &png, &info, nullptr );
+		return false;
+	}
+	
+	png_init_io( png, file );
+	png_read_info( png, info );
+	
+	png_uint_32 width = png_get_image_width( png, info );
+	png_uint_32 height = png_get_image_height( png, info );
+	
+	// largest reduction that is still large enough
+	png_uint_32 reduction = 8;
+	while( reduction > 1 && ( width / reduction < (png_uint_32)size ||
+		height / reduction < (png_uint_32)size ) ){
+		reduction /= 2;
+	}
+	
+	if( png_get_interlace_type( png, info ) != PNG_INTERLACE_ADAM7 ||
+		reduction == 1 ){
+		png_destroy_read_struct( &png, &info, nullptr );
+		return false;
+	}
+	
+	// convert everything to 8 bit BGR, the passes are read as separate images
+	png_set_expand( png );
+	png_set_strip_16( png );
+	png_set_strip_alpha( png );
+	png_set_gray_to_rgb( png );
+	png_set_bgr( png );
+	png_read_update_info( png, info );
+	
+	buffers.row.resize( png_get_rowbytes( png, info ) );
+	buffers.image.create( ( height + reduction - 1 ) / reduction,
+		( width + reduction - 1 ) / reduction, CV_8UC3 );
+	
+	// passes 0, 0-2 or 0-4 contain the pixels at multiples of reduction
+	int last_pass = reduction == 8 ? 0 : reduction == 4 ? 2 : 4;
+	
+	for( int pass = 0; pass <= last_pass; pass++ ){
+		for( png_uint_32 r = 0; r < PNG_PASS_ROWS( height, pass ); r++ ){
+			
+			png_read_row( png, buffers.row.data(), nullptr );
+			
+			uchar* pixels = buffers.image.ptr<uchar>(
+				PNG_ROW_FROM_PASS_ROW( r, pass ) / reduction );
+			for( png_uint_32 c = 0; c < PNG_PASS_COLS( width, pass ); c++ ){
+				memcpy( pixels + PNG_COL_FROM_PASS_COL( c, pass ) / reduction * 3,
+					&buffers.row.at( c*3 ), 3 );
+			}
+		}
+	}
+	
+	png_destroy_read_struct( &png, &info, nullptr );
+	return true;
+}
+
+/**
+ * Decode only the first Adam7 passes of an interlaced PNG image, the
+ * first pass is an image with 1/8 of the resolution, passes 0-2 have 1/4
+ * and passes 0-4 1/2 of the resolution. The fewest passes that are at
+ * least size x size are read, the rest of the file is not read at all.
+ * 
+ * @return empty Mat if the image can't be decoded this way
+ */
+cv::Mat decode_png_interlaced( FILE* file, int size ){
+	
+	png_buffers buffers;
+	
+	if( !read_png_interlaced( file, size, buffers ) )
+		return cv::Mat();
+	
+	cv::Mat image = buffers.image;
+	if( image.cols > size || image.rows > size )
+		cv::resize( image, image, cv::Size( size, size ), 0, 0, cv::INTER_AREA );
+	
+	return image;
+}
+#endif
+
+#ifdef HAVE_LIBTIFF
+/**
+ * libtiff client functions for reading from a FILE
+ */
+tmsize_t tiff_file_read( thandle_t file, void* buffer, tmsize_t size ){
+	return fread( buffer, 1, size, (FILE*)file );
+}
+
+tmsize_t tiff_file_write( thandle_t, void*, tmsize_t ){
+	return 0;
+}
+
+toff_t tiff_file_seek( thandle_t file, toff_t offset, int whence ){
+	return fseeko( (FILE*)file, offset, whence ) == 0 ?
+		ftello( (FILE*)file ) : (toff_t)-1;
+}
+
+int tiff_file_close( thandle_t ){
+	return 0;
+}
+
+toff_t tiff_file_size( thandle_t file ){
+	off_t position = ftello( (FILE*)file );
+	fseeko( (FILE*)file, 0, SEEK_END );
+	off_t size = ftello( (FILE*)file );
+	fseeko( (FILE*)file, position, SEEK_SET );
+	return size;
+}
+
+int tiff_file_map( thandle_t, void**, toff_t* ){
+	return 0;
+}
+
+void tiff_file_unmap( thandle_t, void*, toff_t ){
+}
+
+/**
+ * Open a TIFF image from a FILE, the FILE is not closed by TIFFClose
+ */
+TIFF* tiff_file_open( FILE* file ){
+	return TIFFClientOpen( "image", "rm", (thandle_t)file, tiff_file_read,
+		tiff_file_write, tiff_file_seek, tiff_file_close, tiff_file_size,
+		tiff_file_map, tiff_file_unmap );
+}
+
+/**
+ * Select the smallest resolution level of a pyramidal TIFF image that is
+ * at least size x size pixels. The levels are the SubIFDs of the first
+ * page and the following pages that are marked as reduced images.
+ * 
+ * @return true if a reduced level is selected as the current directory,
+ * false if the full resolution page is selected
+ */
+bool tiff_select_level( TIFF* tiff, int size ){
+	
+	struct level{
+		uint64_t subifd; // 0 for pages
+		tdir_t page;
+		uint64_t pixels;
+	};
+	
+	std::vector< level > levels;
+	uint32_t width = 0, height = 0, type = 0;
+	uint16_t count = 0;
+	toff_t* offsets = nullptr;
+	
+	if( !TIFFSetDirectory( tiff, 0 ) )
+		return false;
+	
+	// the offsets are copied, the array is owned by the directory
+	std::vector< toff_t > subifds;
+	if( TIFFGetField( tiff, TIFFTAG_SUBIFD, &count, &offsets ) && offsets )
+		subifds.assign( offsets, offsets + count );
+	
+	TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &width );
+	TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &height );
+	uint64_t full = (uint64_t)width * height;
+	
+	while( TIFFReadDirectory( tiff ) ){
+		
+		TIFFGetFieldDefaulted( tiff, TIFFTAG_SUBFILETYPE, &type );
+		if( !( type & FILETYPE_REDUCEDIMAGE ) )
+			break;
+		
+		TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &width );
+		TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &height );
+		if( width >= (uint32_t)size && height >= (uint32_t)size )
+			levels.push_back( { 0, TIFFCurrentDirectory( tiff ), (uint64_t)width * height } );
+	}
+	
+	for( toff_t offset : subifds ){
+		
+		if( !TIFFSetSubDirectory( tiff, offset ) )
 			continue;
+		
+		TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &width );
+		TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &height );
+		if( width >= (uint32_t)size && height >= (uint32_t)size )
+			levels.push_back( { offset, 0, (uint64_t)width * height } );
+	}
+	
+	auto best = std::min_element( levels.begin(), levels.end(),
+		[]( const level& a, const level& b ){ return a.pixels < b.pixels; } );
+	
+	if( best == levels.end() || best->pixels >= full ){
+		TIFFSetDirectory( tiff, 0 );
+		return false;
+	}
+	
+	return best->subifd ? TIFFSetSubDirectory( tiff, best->subifd ) :
+		TIFFSetDirectory( tiff, best->page );
+}
+
+/**
+ * Decode the current directory of a TIFF image scanline by scanline (or
+ * tile by tile) and reduce it to size x size pixels
+ * 
+ * @return empty Mat if the image can't be decoded this way
+ */
+cv::Mat decode_tiff_streaming( TIFF* tiff, int size ){
+	
+	uint32_t width = 0, height = 0, rows_per_strip = 0;
+	uint16_t bits = 0, samples = 0, planar = 0, photometric = 0;
+	
+	TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &width );
+	TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &height );
+	TIFFGetFieldDefaulted( tiff, TIFFTAG_BITSPERSAMPLE, &bits );
+	TIFFGetFieldDefaulted( tiff, TIFFTAG_SAMPLESPERPIXEL, &samples );
+	TIFFGetFieldDefaulted( tiff, TIFFTAG_PLANARCONFIG, &planar );
+	TIFFGetFieldDefaulted( tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip );
+	TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &photometric );
+	
+	if( width < (uint32_t)size || height < (uint32_t)size )
+		return cv::Mat();
+	
+	area_accumulator accumulator;
+	accumulator.init( width, height, size );
+	
+	if( TIFFIsTiled( tiff ) ){
+		
+		// tiles are converted to RGBA, the rows are stored bottom-up
+		uint32_t tile_width = 0, tile_height = 0;
+		TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &tile_width );
+		TIFFGetField( tiff, TIFFTAG_TILELENGTH, &tile_height );
+		
+		std::vector< uint32_t > tile( (size_t)tile_width * tile_height );
+		
+		for( uint32_t ty = 0; ty < height; ty += tile_height ){
+			for( uint32_t tx = 0; tx < width; tx += tile_width ){
+				
+				if( !TIFFReadRGBATile( tiff, tx, ty, tile.data() ) )
+					return cv::Mat();
+				
+				for( uint32_t r = 0; r < tile_height && ty + r < height; r++ ){
+					accumulator.add_row( ty + r, tx, std::min( tile_width, width - tx ),
+						(const uchar*)&tile.at( ( tile_height - 1 - r ) * tile_width ),
+						4, 2, 1, 0 );
+				}
+			}
+		}
+		
+	} else if( bits == 8 && planar == PLANARCONFIG_CONTIG &&
+		( ( photometric == PHOTOMETRIC_RGB && samples >= 3 ) ||
+		photometric == PHOTOMETRIC_MINISBLACK ) ){
+		
+		// 8 bit RGB and grayscale images are read directly
+		std::vector< uchar > row( TIFFScanlineSize( tiff ) );
+		bool rgb = photometric == PHOTOMETRIC_RGB;
+		
+		for( uint32_t y = 0; y < height; y++ ){
+			if( TIFFReadScanline( tiff, row.data(), y ) < 0 )
+				return cv::Mat();
+			accumulator.add_row( y, 0, width, row.data(), samples,
+				rgb ? 2 : 0, rgb ? 1 : 0, 0 );
+		}
+		
+	} else if( (uint64_t)rows_per_strip * width <= streaming_max_strip_pixels ){
+		
+		// other images are converted to RGBA strip by strip
+		std::vector< uint32_t > strip( (size_t)rows_per_strip * width );
+		
+		for( uint32_t y = 0; y < height; y += rows_per_strip ){
+			
+			if( !TIFFReadRGBAStrip( tiff, y, strip.data() ) )
+				return cv::Mat();
+			
+			uint32_t rows = std::min( rows_per_strip, height - y );
+			for( uint32_t r = 0; r < rows; r++ ){
+				accumulator.add_row( y + r, 0, width,
+					(const uchar*)&strip.at( ( rows - 1 - r ) * width ), 4, 2, 1, 0 );
+			}
 		}
 		
-		// calculate hash
-		hash_func->compute( current_image, current_hash );
+	} else{
+		return cv::Mat();
+	}
+	
+	return accumulator.result();
+}
+#endif
 
-		// store hash
-		hash_list.at(i) = current_hash;
+#ifdef HAVE_LIBWEBP
+/**
+ * Decode a WebP image directly to size x size pixels with the scaling
+ * of libwebp, the image is never decoded at the full resolution
+ * 
+ * @return empty Mat if the image is animated or smaller than size x size
+ */
+cv::Mat decode_webp_scaled( FILE* file, int size ){
+	
+	long length = fseek( file, 0, SEEK_END ) == 0 ? ftell( file ) : -1;
+	if( length <= 0 )
+		return cv::Mat();
+	
+	std::vector< uint8_t > data( length );
+	if( fseek( file, 0, SEEK_SET ) != 0 ||
+		fread( data.data(), 1, data.size(), file ) != data.size() ){
+		return cv::Mat();
+	}
+	
+	WebPDecoderConfig config;
+	if( !WebPInitDecoderConfig( &config ) ||
+		WebPGetFeatures( data.data(), data.size(), &config.input ) != VP8_STATUS_OK ||
+		config.input.has_animation || config.input.width < size ||
+		config.input.height < size ){
+		
+		return cv::Mat();
 	}
+	
+	cv::Mat image( size, size, CV_8UC3 );
+	
+	config.options.use_scaling = 1;
+	config.options.scaled_width = size;
+	config.options.scaled_height = size;
+	config.output.colorspace = MODE_BGR;
+	config.output.is_external_memory = 1;
+	config.output.u.RGBA.rgba = image.data;
+	config.output.u.RGBA.stride = image.step;
+	config.output.u.RGBA.size = image.step * image.rows;
+	
+	bool success = WebPDecode( data.data(), data.size(), &config ) == VP8_STATUS_OK;
+	WebPFreeDecBuffer( &config.output );
+	
+	return success ? image : cv::Mat();
 }
+#endif
 
+#ifdef HAVE_LIBJPEG
 /**
- * Calculate all similar pairs of images
+ * libjpeg error manager that returns with longjmp instead of exiting
+ */
+struct jpeg_error_manager{
+	jpeg_error_mgr manager;
+	jmp_buf jump;
+};
+
+void jpeg_error_exit( j_common_ptr cinfo ){
+	longjmp( ( (jpeg_error_manager*)cinfo->err )->jump, 1 );
+}
+
+void jpeg_output_message( j_common_ptr ){
+}
+
+/**
+ * Read the first scans of a progressive JPEG image into image, see
+ * decode_jpeg_first_scan. cinfo is owned by the caller, because it is
+ * modified after setjmp.
  * 
- * @param hash_list List of all hash values
- * @param similar_pairs Stores the similar pairs
- * @param threshold Similarity threshold
- * @param thread_id Number of the particular thread
- * @param num_threads Total number of threads
+ * @return false if the image can't be decoded this way
  */
-void calculate_similar_pairs(const std::vector< cv::Mat >& hash_list,
-	std::map< unsigned long, std::set< unsigned long > >& image_similarities,
-	double threshold,
-	unsigned int thread_id, unsigned int num_threads ){
+bool read_jpeg_first_scan( FILE* file, int min_size,
+	jpeg_decompress_struct& cinfo, cv::Mat& image ){
+	
+	if( setjmp( ( (jpeg_error_manager*)cinfo.err )->jump ) )
+		return false;
+	
+	jpeg_create_decompress( &cinfo );
+	jpeg_stdio_src( &cinfo, file );
+	jpeg_read_header( &cinfo, TRUE );
+	
+	// the DC coefficients are an image with 1/8 of the resolution
+	if( !cinfo.progressive_mode || cinfo.image_width / 8 < (unsigned int)min_size ||
+		cinfo.image_height / 8 < (unsigned int)min_size ||
+		( cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_RGB &&
+		cinfo.jpeg_color_space != JCS_GRAYSCALE ) ){
+		return false;
+	}
+	
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = 8;
+	cinfo.buffered_image = TRUE;
+	cinfo.out_color_space = cinfo.jpeg_color_space == JCS_GRAYSCALE ?
+		JCS_GRAYSCALE : JCS_RGB;
+	jpeg_start_decompress( &cinfo );
+	
+	// true if the scans so far contain the DC coefficients of all components
+	auto dc_complete = [&](){
+		for( int c = 0; c < cinfo.num_components; c++ ){
+			if( cinfo.coef_bits[c][0] < 0 )
+				return false;
+		}
+		return true;
+	};
+	
+	// read the input up to the end of the first scan, or of the first
+	// scans if they contain the DC coefficients of only some of the
+	// components (e.g. the luma DC scan of mozjpeg)
+	int status;
+	do{
+		status = jpeg_consume_input( &cinfo );
+	} while( status != JPEG_REACHED_EOI && status != JPEG_SUSPENDED &&
+		( status != JPEG_SCAN_COMPLETED || !dc_complete() ) );
+	
+	if( !dc_complete() )
+		return false;
+	
+	jpeg_start_output( &cinfo, cinfo.input_scan_number );
+	
+	image.create( cinfo.output_height, cinfo.output_width,
+		CV_8UC( cinfo.output_components ) );
+	while( cinfo.output_scanline < cinfo.output_height ){
+		JSAMPROW row = image.ptr<uchar>( cinfo.output_scanline );
+		jpeg_read_scanlines( &cinfo, &row, 1 );
+	}
+	
+	jpeg_finish_output( &cinfo );
+	return true;
+}
+
+/**
+ * Decode only the first scan of a progressive JPEG image, which usually
+ * contains the DC coefficients of the whole image (1/8 of the
+ * resolution). The file is read up to the end of the first scan that
+ * completes the DC coefficients of all components.
+ * 
+ * @param min_size The DC image must be at least min_size x min_size
+ * @param size Larger DC images are reduced to size x size
+ * @return empty Mat if the image is not progressive or too small
+ */
+cv::Mat decode_jpeg_first_scan( FILE* file, int min_size, int size ){
+	
+	cv::Mat image;
+	jpeg_decompress_struct cinfo = {};
+	jpeg_error_manager error;
+	
+	cinfo.err = jpeg_std_error( &error.manager );
+	error.manager.error_exit = jpeg_error_exit;
+	error.manager.output_message = jpeg_output_message;
+	
+	if( fseek( file, 0, SEEK_SET ) != 0 )
+		return cv::Mat();
+	
+	bool success = read_jpeg_first_scan( file, min_size, cinfo, image );
+	jpeg_destroy_decompress( &cinfo );
+	
+	if( !success )
+		return cv::Mat();
+	
+	cv::cvtColor( image, image, image.channels() == 1 ?
+		cv::COLOR_GRAY2BGR : cv::COLOR_RGB2BGR );
+	
+	if( image.cols > size || image.rows > size )
+		cv::resize( image, image, cv::Size( size, size ), 0, 0, cv::INTER_AREA );
+	
+	return image;
+}
+#endif
+
+/**
+ * Budget of decoded image memory shared by all workers. A worker reserves
+ * the expected size of the decoded image (from the header) before
+ * decoding it and waits until enough memory is released.
+ */
+struct memory_budget{
+	
+	unsigned long long total = 0, used = 0; // bytes, total 0 is unlimited
+	std::mutex budget_mutex;
+	std::condition_variable released;
+	
+	// bytes reserved by the calling thread
+	static inline thread_local unsigned long long held = 0;
+	
+	/**
+	 * Wait until bytes (at most the budget not held by the calling thread)
+	 * are available, a thread never waits for its own reservations
+	 * 
+	 * @return number of reserved bytes, for release()
+	 */
+	unsigned long long reserve( unsigned long long bytes ){
+		
+		if( total == 0 )
+			return 0;
+		
+		bytes = std::min( bytes, total - held );
+		std::unique_lock< std::mutex > lock( budget_mutex );
+		released.wait( lock, [&]{ return used + bytes <= total; } );
+		used += bytes;
+		held += bytes;
+		return bytes;
+	}
+	
+	void release( unsigned long long bytes ){
+		
+		if( bytes == 0 )
+			return;
+		
+		budget_mutex.lock();
+		used -= bytes;
+		held -= bytes;
+		budget_mutex.unlock();
+		released.notify_all();
+	}
+	
+	/**
+	 * Images that would take more than a quarter of the budget are
+	 * decoded with a reduced resolution or row by row
+	 */
+	bool oversized( unsigned long long bytes ) const{
+		return total != 0 && bytes > total / 4;
+	}
+};
+
+// Memory budget of all calculate_hash_values threads
+memory_budget decode_budget;
+
+/**
+ * Get the expected size of the decoded image in bytes, images whose
+ * header can't be read are assumed to be as large as unknown_decoded_bytes
+ */
+unsigned long long decoded_bytes( const image_header& header ){
+	
+	if( header.width == 0 || header.height == 0 )
+		return unknown_decoded_bytes;
+	
+	return (unsigned long long)header.width * header.height * 3;
+}
+
+// Use the reduced resolution decoding of the formats that support it
+bool reduced_decoding = true;
+
+// Smallest first scan of a progressive JPEG that replaces a full decode,
+// the size the descriptors (and regions) resize their input to, 0 for
+// the size of the reduced image
+int first_scan_min_size = 0;
+
+// Images with more pixels are reported instead of decoded, 0 is unlimited
+unsigned long long max_decode_pixels = 0;
+
+// Decoding that takes longer is aborted (seconds), 0 is unlimited
+double max_decode_seconds = 0;
+
+/**
+ * Page cache usage of the image reads in the hashing stage
+ */
+enum cache_mode{
+	cache_default, // normal reads
+	cache_dontneed, // prefetch the next files, drop each file after hashing
+	cache_direct // read the whole files with O_DIRECT
+};
+
+cache_mode page_cache = cache_default;
+
+/**
+ * Token bucket that limits the rate of an operation shared by all
+ * workers. The tokens of one second can be used at once, larger amounts
+ * are taken on credit and the following takes wait until it is repaid.
+ */
+struct token_bucket{
+	
+	double rate = 0; // per second, 0 is unlimited
+	double tokens = 0;
+	std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+	std::mutex bucket_mutex;
+	
+	/**
+	 * Wait until amount tokens are available
+	 */
+	void take( double amount ){
+		
+		if( rate <= 0 )
+			return;
+		
+		bucket_mutex.lock();
+		auto now = std::chrono::steady_clock::now();
+		tokens = std::min( rate, tokens + rate *
+			std::chrono::duration< double >( now - last ).count() );
+		last = now;
+		tokens -= amount;
+		double wait = tokens < 0 ? -tokens / rate : 0;
+		bucket_mutex.unlock();
+		
+		if( wait > 0 )
+			std::this_thread::sleep_for( std::chrono::duration< double >( wait ) );
+	}
+};
+
+// Rate limits of the hashing stage: bytes read and files opened per second
+token_bucket read_limit, open_limit;
+
+/**
+ * Get the number of bytes the calling thread has read so far (rchar of
+ * /proc/thread-self/io), decoders that stop early are only charged for
+ * what they read
+ * 
+ * @return 0 if not available
+ */
+unsigned long long thread_bytes_read(){
+	
+	std::ifstream io( "/proc/thread-self/io" );
+	std::string key;
+	unsigned long long value;
+	
+	while( io >> key >> value ){
+		if( key == "rchar:" )
+			return value;
+	}
+	return 0;
+}
+
+#ifdef HAVE_LIBHEIF
+/**
+ * Decode a HEIF or AVIF image with libheif and reduce it to size x size
+ * pixels. The smallest thumbnail item that is at least size x size is
+ * decoded instead of the primary image if there is one.
+ * 
+ * @param thumbnails Allow decoding a thumbnail item
+ * @return empty Mat if the image can't be decoded
+ */
+cv::Mat decode_heif( const std::string& filename, int size, bool thumbnails ){
+	
+	cv::Mat image;
+	heif_context* context = heif_context_alloc();
+	heif_image_handle* primary = nullptr;
+	heif_image_handle* thumbnail = nullptr;
+	
+	if( heif_context_read_from_file( context, filename.c_str(), nullptr ).code != heif_error_Ok ||
+		heif_context_get_primary_image_handle( context, &primary ).code != heif_error_Ok ){
+		
+		heif_context_free( context );
+		return cv::Mat();
+	}
+	
+	int count = thumbnails ? heif_image_handle_get_number_of_thumbnails( primary ) : 0;
+	std::vector< heif_item_id > ids( count );
+	if( count > 0 )
+		heif_image_handle_get_list_of_thumbnail_IDs( primary, ids.data(), count );
+	
+	for( heif_item_id id : ids ){
+		
+		heif_image_handle* handle;
+		if( heif_image_handle_get_thumbnail( primary, id, &handle ).code != heif_error_Ok )
+			continue;
+		
+		long width = heif_image_handle_get_width( handle );
+		long height = heif_image_handle_get_height( handle );
+		
+		if( width >= size && height >= size && ( !thumbnail || width * height <
+			(long)heif_image_handle_get_width( thumbnail ) * heif_image_handle_get_height( thumbnail ) ) ){
+			
+			if( thumbnail )
+				heif_image_handle_release( thumbnail );
+			thumbnail = handle;
+		} else{
+			heif_image_handle_release( handle );
+		}
+	}
+	
+	// the full decoded size is reserved for the primary image
+	heif_image_handle* selected = thumbnail ? thumbnail : primary;
+	unsigned long long reserved = thumbnail ? 0 : decode_budget.reserve(
+		(unsigned long long)heif_image_handle_get_width( primary ) *
+		heif_image_handle_get_height( primary ) * 3 );
+	
+	heif_image* decoded = nullptr;
+	if( heif_decode_image( selected, &decoded, heif_colorspace_RGB,
+		heif_chroma_interleaved_RGB, nullptr ).code == heif_error_Ok ){
+		
+		int stride;
+		const uint8_t* data = heif_image_get_plane_readonly( decoded,
+			heif_channel_interleaved, &stride );
+		
+		if( data ){
+			cv::Mat rgb( heif_image_get_height( decoded, heif_channel_interleaved ),
+				heif_image_get_width( decoded, heif_channel_interleaved ), CV_8UC3,
+				(void*)data, stride );
+			
+			if( rgb.cols > size || rgb.rows > size )
+				cv::resize( rgb, image, cv::Size( size, size ), 0, 0, cv::INTER_AREA );
+			else
+				image = rgb.clone();
+			cv::cvtColor( image, image, cv::COLOR_RGB2BGR );
+		}
+		heif_image_release( decoded );
+	}
+	
+	decode_budget.release( reserved );
+	
+	if( thumbnail )
+		heif_image_handle_release( thumbnail );
+	heif_image_handle_release( primary );
+	heif_context_free( context );
+	
+	return image;
+}
+#endif
+
+/**
+ * Decode the embedded JPEG preview of a RAW image found by read_raw_header
+ * 
+ * @param flags Flags for cv::imdecode
+ * @return empty Mat if the preview can't be read
+ */
+cv::Mat decode_raw_preview( const std::string& filename,
+	const image_header& header, int flags ){
+	
+	FILE* file = fopen( filename.c_str(), "rb" );
+	if( !file )
+		return cv::Mat();
+	
+	// the offset and length come from the file, don't allocate more than
+	// the file contains
+	struct stat st;
+	if( fstat( fileno( file ), &st ) != 0 ||
+		header.preview_offset > (unsigned long)st.st_size ||
+		header.preview_length > (unsigned long)st.st_size - header.preview_offset ){
+		fclose( file );
+		return cv::Mat();
+	}
+	
+	std::vector< uchar > data( header.preview_length );
+	bool success = fseek( file, header.preview_offset, SEEK_SET ) == 0 &&
+		fread( data.data(), 1, data.size(), file ) == data.size();
+	fclose( file );
+	
+	return success ? cv::imdecode( data, flags ) : cv::Mat();
+}
+
+/**
+ * How decode_image decodes an image
+ */
+struct decode_plan{
+	bool streaming; // large PNG and TIFF images row by row
+	bool reduced; // with the reduced resolution decoders of the formats
+	bool scaled; // only the reduced image is held while decoding
+	int flags; // for cv::imread, with the JPEG and RAW reduction
+	unsigned long long bytes; // reserved from decode_budget for cv::imread
+};
+
+/**
+ * Decide how decode_image decodes an image, see there
+ * 
+ * @param in_memory The image is decoded with cv::imdecode
+ */
+decode_plan plan_decode( const image_header& header, int size, bool in_memory ){
+	
+	decode_plan plan = {};
+	plan.bytes = decoded_bytes( header );
+	plan.streaming = !in_memory && ( header.width * header.height >=
+		streaming_min_pixels || decode_budget.oversized( plan.bytes ) );
+	plan.reduced = !in_memory && reduced_decoding;
+	
+	// PNG and TIFF images decoded row by row and WebP images scaled by
+	// libwebp, the first scan of progressive JPEG images needs the
+	// coefficients of the whole image
+#ifdef HAVE_LIBPNG
+	if( header.format == format_png &&
+		( plan.streaming || ( header.progressive && plan.reduced ) ) ){
+		plan.scaled = true;
+	}
+#endif
+#ifdef HAVE_LIBTIFF
+	if( header.format == format_tiff && plan.streaming )
+		plan.scaled = true;
+#endif
+#ifdef HAVE_LIBWEBP
+	if( header.format == format_webp && plan.reduced )
+		plan.scaled = true;
+#endif
+	
+	// JPEG images can be decoded with 1/2, 1/4 or 1/8 of the resolution
+	plan.flags = cv::IMREAD_COLOR | cv::IMREAD_IGNORE_ORIENTATION;
+	
+	// RAW previews are always decoded as small as possible
+	bool reduce = header.format == format_raw && reduced_decoding;
+	
+	if( header.format == format_jpeg || header.format == format_raw ){
+		for( int reduction : { 2, 4, 8 } ){
+			
+			if( !( reduce || decode_budget.oversized( plan.bytes ) ) ||
+				header.width / reduction < (unsigned long)size ||
+				header.height / reduction < (unsigned long)size ){
+				break;
+			}
+			
+			plan.bytes /= 4;
+			plan.flags = ( reduction == 2 ? cv::IMREAD_REDUCED_COLOR_2 :
+				reduction == 4 ? cv::IMREAD_REDUCED_COLOR_4 :
+				cv::IMREAD_REDUCED_COLOR_8 ) | cv::IMREAD_IGNORE_ORIENTATION;
+		}
+	}
+	
+	return plan;
+}
+
+/**
+ * Decode an image for hashing and reduce it to at most size x size
+ * pixels. The EXIF orientation is not applied.
+ * 
+ * Large PNG and TIFF images are decoded row by row and reduced while
+ * they are read, so the memory doesn't depend on the image size. Only
+ * the first passes of interlaced PNG images, the first scan of
+ * progressive JPEG images and the smallest sufficient level of pyramidal
+ * TIFF images are decoded. WebP images are scaled by libwebp while they
+ * are decoded. RAW images are decoded from their embedded JPEG preview
+ * with the smallest sufficient resolution, HEIF and AVIF images from
+ * their thumbnail item if it is large enough. All other images are
+ * decoded with cv::imread, JPEG images that exceed the memory budget
+ * with a reduced resolution. The expected decoded size is reserved from
+ * decode_budget until the image is reduced.
+ * 
+ * Images in memory (members of archives) are always decoded with
+ * cv::imdecode.
+ * 
+ * @param header Header of the image (format_unknown if not available)
+ * @param size Size of the reduced image
+ * @param data Encoded image, if not nullptr filename is not read
+ * @return empty Mat if the image can't be decoded
+ */
+cv::Mat decode_image( const std::string& filename, const image_header& header,
+	int size, const std::vector< uchar >* data = nullptr ){
+	
+	cv::Mat image;
+	decode_plan plan = plan_decode( header, size, data != nullptr );
+	
+#ifdef HAVE_LIBPNG
+	if( header.format == format_png && plan.scaled ){
+		
+		FILE* file = fopen( filename.c_str(), "rb" );
+		if( file ){
+			image = header.progressive && plan.reduced ?
+				decode_png_interlaced( file, size ) :
+				decode_png_streaming( file, size );
+			fclose( file );
+		}
+	}
+#endif
+	
+#ifdef HAVE_LIBTIFF
+	if( header.format == format_tiff && ( plan.streaming || plan.reduced ) ){
+		FILE* file = fopen( filename.c_str(), "rb" );
+		TIFF* tiff = file ? tiff_file_open( file ) : nullptr;
+		if( tiff ){
+			// reduced resolution levels are used regardless of the image size
+			if( ( plan.reduced && tiff_select_level( tiff, size ) ) || plan.streaming )
+				image = decode_tiff_streaming( tiff, size );
+			TIFFClose( tiff );
+		}
+		if( file )
+			fclose( file );
+	}
+#endif
+	
+#ifdef HAVE_LIBJPEG
+	if( header.format == format_jpeg && header.progressive && plan.reduced ){
+		FILE* file = fopen( filename.c_str(), "rb" );
+		if( file ){
+			image = decode_jpeg_first_scan( file, first_scan_min_size > 0 ?
+				std::min( size, first_scan_min_size ) : size, size );
+			fclose( file );
+		}
+	}
+#endif
+	
+#ifdef HAVE_LIBWEBP
+	if( header.format == format_webp && plan.scaled ){
+		FILE* file = fopen( filename.c_str(), "rb" );
+		if( file ){
+			image = decode_webp_scaled( file, size );
+			fclose( file );
+		}
+	}
+#endif
+	
+#ifdef HAVE_LIBHEIF
+	if( header.format == format_heif && !data )
+		return decode_heif( filename, size, plan.reduced );
+#endif
+	
+	if( image.data )
+		return image;
+	
+	unsigned long long reserved = decode_budget.reserve( plan.bytes );
+	
+	if( data && header.format == format_raw ){
+		
+		// the preview of a RAW image in memory is decoded in place
+		if( header.preview_offset <= data->size() &&
+			header.preview_length <= data->size() - header.preview_offset ){
+			
+			image = cv::imdecode( cv::Mat( 1, header.preview_length, CV_8U,
+				(void*)( data->data() + header.preview_offset ) ), plan.flags );
+		}
+		
+	} else if( data )
+		image = cv::imdecode( *data, plan.flags );
+	else if( header.format == format_raw )
+		image = decode_raw_preview( filename, header, plan.flags );
+	else
+		image = cv::imread( filename, plan.flags );
+	
+	// reduce the image once for all descriptors
+	if( image.cols > size || image.rows > size )
+		cv::resize( image, image, cv::Size( size, size ), 0, 0, cv::INTER_AREA );
+	
+	decode_budget.release( reserved );
+	
+	return image;
+}
+
+/**
+ * Report an image that is not hashed because it exceeds a decode limit
+ */
+void report_skipped( const std::string& filename, const std::string& reason ){
+	mu.lock();
+	std::cerr << "Skipping " << filename << ": " << reason << "\n";
+	mu.unlock();
+}
+
+// Argument that starts the program as a decode worker process (-T)
+const char* const decode_worker_argument = "--decode-worker";
+
+// File descriptor of the socket of a decode worker process
+const int decode_worker_fd = 3;
+
+/**
+ * Request to a decode worker process, followed by the filename and the
+ * encoded image (if has_data)
+ */
+struct worker_request{
+	image_header header;
+	int size;
+	bool reduced_decoding, has_data;
+	int first_scan_min_size;
+	unsigned long long budget; // total of decode_budget
+	size_t filename_size, data_size;
+};
+
+/**
+ * Reply of a decode worker process, followed by the pixels of the
+ * reduced image
+ */
+struct worker_reply{
+	int rows, cols, type;
+	unsigned long long bytes_read; // by the worker for the request, for read_limit
+};
+
+/**
+ * Write to a socket, a closed socket is an error instead of SIGPIPE
+ * 
+ * @return false if not all bytes were written
+ */
+bool send_all( int fd, const void* buffer, size_t bytes ){
+	
+	const uchar* p = (const uchar*)buffer;
+	while( bytes > 0 ){
+		ssize_t sent = send( fd, p, bytes, MSG_NOSIGNAL );
+		if( sent <= 0 )
+			return false;
+		p += sent;
+		bytes -= sent;
+	}
+	return true;
+}
+
+/**
+ * Main function of a decode worker process, decodes the image of each
+ * worker_request on decode_worker_fd and writes a worker_reply back until
+ * the socket is closed
+ * 
+ * @return exit status
+ */
+int run_decode_worker(){
+	
+	auto receive_all = []( void* buffer, size_t bytes ){
+		uchar* p = (uchar*)buffer;
+		while( bytes > 0 ){
+			ssize_t n = read( decode_worker_fd, p, bytes );
+			if( n <= 0 )
+				return false;
+			p += n;
+			bytes -= n;
+		}
+		return true;
+	};
+	
+	worker_request request;
+	std::string filename;
+	std::vector< uchar > data;
+	
+	while( receive_all( &request, sizeof(request) ) ){
+		
+		filename.resize( request.filename_size );
+		data.resize( request.data_size );
+		if( !receive_all( filename.data(), filename.size() ) ||
+			!receive_all( data.data(), data.size() ) ){
+			return 1;
+		}
+		
+		// only the reads of the decoding are reported, the request was read
+		// from the parent and the loader read the libraries at startup
+		unsigned long long bytes_read = thread_bytes_read();
+		
+		// the same decoding as in the parent, whose budget is already reserved
+		reduced_decoding = request.reduced_decoding;
+		first_scan_min_size = request.first_scan_min_size;
+		decode_budget.total = request.budget;
+		
+		cv::Mat image = decode_image( filename, request.header, request.size,
+			request.has_data ? &data : nullptr );
+		if( !image.isContinuous() )
+			image = image.clone();
+		
+		// the encoded image of an archive member isn't kept until the next one
+		std::vector< uchar >().swap( data );
+		
+		worker_reply reply = { image.rows, image.cols, image.type(),
+			thread_bytes_read() - bytes_read };
+		if( !send_all( decode_worker_fd, &reply, sizeof(reply) ) ||
+			!send_all( decode_worker_fd, image.data, image.total() * image.elemSize() ) ){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Decode worker process of a hashing thread, it decodes all images of
+ * the thread until it is killed or crashes
+ */
+struct decode_worker{
+	pid_t pid = 0;
+	int fd = -1; // socket to the worker, -1 if not running
+	unsigned long long received = 0; // bytes of all replies, not taken from read_limit
+};
+
+/**
+ * Start a decode worker process. The worker is this program started
+ * again with decode_worker_argument, not a fork, so it doesn't inherit
+ * the locks and the page tables of the hashing threads. It gets the end
+ * of a socket that no other worker inherits.
+ * 
+ * @return false if the process can't be started
+ */
+bool start_decode_worker( decode_worker& worker ){
+	
+	int fds[2];
+	if( socketpair( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds ) != 0 )
+		return false;
+	
+	// only the end of this worker is passed on, as decode_worker_fd
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init( &actions );
+	posix_spawn_file_actions_adddup2( &actions, fds[1], decode_worker_fd );
+	
+	std::string name = "img-similarity-cluster", argument = decode_worker_argument;
+	char* argv[] = { name.data(), argument.data(), nullptr };
+	bool spawned = posix_spawn( &worker.pid, "/proc/self/exe", &actions, nullptr,
+		argv, environ ) == 0;
+	
+	posix_spawn_file_actions_destroy( &actions );
+	close( fds[1] );
+	
+	if( !spawned ){
+		close( fds[0] );
+		return false;
+	}
+	
+	worker.fd = fds[0];
+	return true;
+}
+
+/**
+ * Stop a decode worker process, a worker that isn't killed exits when
+ * its socket is closed
+ */
+void stop_decode_worker( decode_worker& worker, bool kill_worker = false ){
+	
+	if( worker.fd < 0 )
+		return;
+	
+	if( kill_worker )
+		kill( worker.pid, SIGKILL );
+	close( worker.fd );
+	waitpid( worker.pid, nullptr, 0 );
+	worker.fd = -1;
+}
+
+/**
+ * Decode an image like decode_image in the decode worker process of the
+ * thread, which is killed after max_decode_seconds, so that a
+ * pathological file can't stall a thread. The worker is started for the
+ * first image and again after it was killed or crashed. The request and
+ * the reduced image are exchanged through its socket. The expected
+ * memory of the decoding is reserved from decode_budget, only the reduced
+ * image for the formats that are scaled while decoding, and the bytes
+ * read by the worker are taken from read_limit by the parent.
+ * 
+ * @param worker Decode worker of the calling thread
+ * @param timed_out Set if the time limit was exceeded, a worker that
+ * crashed is a decoding failure
+ * @return empty Mat if the image can't be decoded in time
+ */
+cv::Mat decode_image_in_worker( decode_worker& worker, const std::string& filename,
+	const image_header& header, int size, const std::vector< uchar >* data,
+	bool& timed_out ){
+	
+	cv::Mat image;
+	timed_out = false;
+	
+	if( worker.fd < 0 && !start_decode_worker( worker ) )
+		return image;
+	
+	decode_plan plan = plan_decode( header, size, data != nullptr );
+	unsigned long long reserved = decode_budget.reserve( plan.scaled ?
+		(unsigned long long)size * size * 3 : plan.bytes );
+	
+	worker_request request = { header, size, reduced_decoding, data != nullptr,
+		first_scan_min_size, decode_budget.total, filename.size(),
+		data ? data->size() : 0 };
+	bool sent = send_all( worker.fd, &request, sizeof(request) ) &&
+		send_all( worker.fd, filename.data(), filename.size() ) &&
+		( !data || send_all( worker.fd, data->data(), data->size() ) );
+	
+	// read until the image is complete or the time is up, the socket is
+	// closed early if the worker crashed
+	auto deadline = std::chrono::steady_clock::now() +
+		std::chrono::duration< double >( max_decode_seconds );
+	
+	auto read_all = [&]( void* buffer, size_t bytes ){
+		
+		uchar* p = (uchar*)buffer;
+		while( bytes > 0 ){
+			
+			long remaining = std::chrono::duration_cast< std::chrono::milliseconds >(
+				deadline - std::chrono::steady_clock::now() ).count();
+			pollfd readable = { worker.fd, POLLIN, 0 };
+			
+			if( remaining <= 0 || poll( &readable, 1, remaining ) == 0 ){
+				timed_out = true;
+				return false;
+			}
+			
+			ssize_t n = read( worker.fd, p, bytes );
+			if( n <= 0 )
+				return false;
+			worker.received += n;
+			p += n;
+			bytes -= n;
+		}
+		return true;
+	};
+	
+	worker_reply reply;
+	bool complete = false;
+	
+	if( sent && read_all( &reply, sizeof(reply) ) && reply.rows >= 0 &&
+		reply.rows <= size && reply.cols >= 0 && reply.cols <= size ){
+		
+		read_limit.take( reply.bytes_read );
+		image.create( reply.rows, reply.cols, reply.type );
+		complete = read_all( image.data, image.total() * image.elemSize() );
+	}
+	
+	// a worker that didn't reply completely is replaced for the next image
+	if( !complete ){
+		image = cv::Mat();
+		stop_decode_worker( worker, true );
+	}
+	
+	decode_budget.release( reserved );
+	
+	return image;
+}
+
+/**
+ * Frames of multi-frame images (animated GIF, multi-page TIFF) that are
+ * hashed
+ */
+struct frame_selection{
+	unsigned int count = 1; // 0 for all frames
+	bool sampled = false; // evenly spaced frames instead of the first frames
+	double video_interval = 0; // seconds between video frames, 0 skips videos
+};
+
+/**
+ * Get the pages of a TIFF file in the order of cv::ImageCollection (the
+ * IFD chain), without the reduced resolution pages of pyramidal TIFFs
+ * (NewSubfileType bit 0)
+ * 
+ * @return positions of the full resolution pages, empty if the file
+ * can't be read
+ */
+std::vector< size_t > tiff_full_pages( const std::string& filename ){
+	
+	std::vector< size_t > pages;
+	FILE* file = fopen( filename.c_str(), "rb" );
+	if( !file )
+		return pages;
+	
+	tiff_reader reader;
+	uint32_t ifd;
+	
+	if( tiff_open( file, 0, reader, ifd ) ){
+		
+		// the chain is followed until it ends or loops
+		std::unordered_set< uint32_t > visited;
+		for( size_t page = 0; ifd != 0 && visited.insert( ifd ).second; page++ ){
+			
+			std::vector< tiff_entry > entries;
+			uint32_t next = 0;
+			if( !tiff_read_ifd( reader, ifd, entries, &next ) )
+				break;
+			
+			const tiff_entry* subfile_type = tiff_find( entries, 0xfe );
+			if( !subfile_type || !( tiff_value( reader, *subfile_type ) & 1 ) )
+				pages.push_back( page );
+			ifd = next;
+		}
+	}
+	
+	fclose( file );
+	return pages;
+}
+
+/**
+ * Decode the selected frames of a multi-frame image and reduce them to
+ * size x size pixels. The EXIF orientation is not applied. The reduced
+ * resolution pages of pyramidal TIFFs are not frames.
+ * 
+ * The frames are decoded in one pass up to the last selected frame, each
+ * frame is reduced as soon as it is decoded, so only one frame has the
+ * full resolution at a time (this is also required for GIF frames that
+ * only contain the changes to the previous frame). The size of one
+ * decoded frame is reserved from decode_budget during the pass.
+ * 
+ * @param header Header of the image
+ * @return empty if the image has a single frame, it is decoded by
+ * decode_image
+ */
+std::vector< cv::Mat > decode_frames( const std::string& filename,
+	const image_header& header, const frame_selection& frames, int size ){
+	
+	std::vector< cv::Mat > result;
+	
+	// positions of the frames in the collection
+	std::vector< size_t > pages;
+	if( header.format == format_tiff ){
+		pages = tiff_full_pages( filename );
+		if( pages.size() == 1 )
+			return result;
+	}
+	
+	unsigned long long reserved = decode_budget.reserve( decoded_bytes( header ) );
+	
+	try{
+		
+		cv::ImageCollection collection( filename,
+			cv::IMREAD_COLOR | cv::IMREAD_IGNORE_ORIENTATION );
+		
+		if( pages.empty() ){
+			for( size_t f = 0; f < collection.size(); f++ )
+				pages.push_back( f );
+		}
+		
+		size_t total = pages.size();
+		size_t count = frames.count == 0 ? total :
+			std::min( (size_t)frames.count, total );
+		
+		// every page up to the last selected frame is read in order, the
+		// collection reopens the file for a page that is not the next one
+		size_t k = 0;
+		for( size_t f = 0; total > 1 && k < count && f < collection.size(); f++ ){
+			
+			cv::Mat frame = collection.at( f );
+			collection.releaseCache( f );
+			
+			if( !frame.data )
+				break;
+			
+			// frame k*total/count is the k-th sample, frame k without sampling
+			if( f != pages.at( frames.sampled ? k * total / count : k ) )
+				continue;
+			k++;
+			
+			if( frame.cols > size || frame.rows > size )
+				cv::resize( frame, frame, cv::Size( size, size ), 0, 0, cv::INTER_AREA );
+			result.push_back( frame );
+		}
+		
+	} catch( std::exception &e ){
+		result.clear();
+	}
+	
+	decode_budget.release( reserved );
+	return result;
+}
+
+/**
+ * Check the file extension for a video format
+ */
+bool is_video_file( const std::string& filename ){
+	
+	std::string extension = std::filesystem::path( filename ).extension();
+	std::transform( extension.begin(), extension.end(), extension.begin(),
+		[]( unsigned char c ){ return std::tolower( c ); } );
+	
+	for( const char* video : { ".mp4", ".m4v", ".mov", ".mkv", ".webm", ".avi",
+		".wmv", ".mpg", ".mpeg", ".3gp", ".mts", ".m2ts" } ){
+		
+		if( extension == video )
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Decode one frame every interval seconds of a video (at most
+ * max_video_frames) with the software decoder and reduce the frames to
+ * size x size pixels. The capture seeks to each frame, so the frames in
+ * between are skipped up to the preceding keyframe.
+ * 
+ * @return empty if the video can't be read
+ */
+std::vector< cv::Mat > decode_video_frames( const std::string& filename,
+	double interval, int size ){
+	
+	std::vector< cv::Mat > result;
+	cv::VideoCapture capture( filename, cv::CAP_FFMPEG,
+		{ cv::CAP_PROP_HW_ACCELERATION, cv::VIDEO_ACCELERATION_NONE } );
+	
+	if( !capture.isOpened() )
+		return result;
+	
+	if( max_decode_pixels && capture.get( cv::CAP_PROP_FRAME_WIDTH ) *
+		capture.get( cv::CAP_PROP_FRAME_HEIGHT ) > max_decode_pixels ){
+		report_skipped( filename, "exceeds the pixel limit" );
+		return result;
+	}
+	
+	double fps = capture.get( cv::CAP_PROP_FPS );
+	double frame_count = capture.get( cv::CAP_PROP_FRAME_COUNT );
+	double duration = fps > 0 ? frame_count / fps : 0;
+	
+	for( double t = 0; result.size() < max_video_frames &&
+		( t == 0 || t < duration ); t += interval ){
+		
+		cv::Mat frame;
+		if( !capture.set( cv::CAP_PROP_POS_MSEC, t * 1000 ) || !capture.read( frame ) ||
+			!frame.data ){
+			break;
+		}
+		
+		if( frame.cols > size || frame.rows > size )
+			cv::resize( frame, frame, cv::Size( size, size ), 0, 0, cv::INTER_AREA );
+		result.push_back( frame );
+	}
+	
+	return result;
+}
+
+/**
+ * Apply an EXIF orientation to an image. The images are usually reduced
+ * to a square first, so this doesn't touch the full resolution image.
+ */
+void apply_orientation( cv::Mat& image, unsigned int orientation ){
+	
+	cv::Mat transposed;
+	
+	switch( orientation ){
+		case 2: // mirror horizontally
+			cv::flip( image, image, 1 );
+			break;
+		case 3: // rotate by 180 degrees
+			cv::flip( image, image, -1 );
+			break;
+		case 4: // mirror vertically
+			cv::flip( image, image, 0 );
+			break;
+		case 5: // transpose
+			cv::transpose( image, transposed );
+			image = transposed;
+			break;
+		case 6: // rotate by 90 degrees clockwise
+			cv::rotate( image, transposed, cv::ROTATE_90_CLOCKWISE );
+			image = transposed;
+			break;
+		case 7: // transpose and rotate by 180 degrees
+			cv::transpose( image, transposed );
+			cv::flip( transposed, image, -1 );
+			break;
+		case 8: // rotate by 90 degrees counterclockwise
+			cv::rotate( image, transposed, cv::ROTATE_90_COUNTERCLOCKWISE );
+			image = transposed;
+			break;
+		default:
+			break;
+	}
+}
+
+/**
+ * Reduce an image to a normalized thumbnail (thumbnail_size squared,
+ * grayscale or BGR)
+ */
+cv::Mat make_thumbnail( const cv::Mat& image, int channels ){
+	
+	cv::Mat thumbnail;
+	
+	cv::resize( image, thumbnail, cv::Size( thumbnail_size, thumbnail_size ),
+		0, 0, cv::INTER_AREA );
+	
+	if( channels == 1 && thumbnail.channels() == 3 ){
+		cv::cvtColor( thumbnail, thumbnail, cv::COLOR_BGR2GRAY );
+	} else if( channels == 3 && thumbnail.channels() == 1 ){
+		cv::cvtColor( thumbnail, thumbnail, cv::COLOR_GRAY2BGR );
+	}
+	
+	return thumbnail;
+}
+
+/**
+ * Store of small normalized thumbnails, all descriptors can be
+ * recalculated from the thumbnails without decoding the images again.
+ * 
+ * The store is a single file that is read with mmap:
+ * header, count thumbnails, count records, filenames, directories,
+ * directory entries
+ * A new store is written next to the old one during the hash
+ * calculation and replaces it in close().
+ * 
+ * The directories are the listings of the last run, with -u unchanged
+ * directories aren't listed again.
+ */
+struct thumbnail_store{
+	
+	/**
+	 * File header
+	 */
+	struct header{
+		char magic[8];
+		uint32_t version, size, channels, reserved;
+		uint64_t count, records_offset, strings_offset;
+		uint64_t directories_count, directories_offset, entries_offset;
+	};
+	
+	/**
+	 * Metadata of a thumbnail
+	 */
+	struct record{
+		uint64_t file_size;
+		int64_t mtime; // nanoseconds
+		uint64_t path_offset;
+		uint32_t path_length, valid;
+	};
+	
+	/**
+	 * Metadata and listing of a directory
+	 */
+	struct directory{
+		int64_t mtime; // nanoseconds
+		uint64_t links; // changes with the number of subdirectories
+		uint64_t path_offset, first_entry, entry_count;
+		uint32_t path_length, reserved;
+	};
+	
+	/**
+	 * File or subdirectory in a directory
+	 */
+	struct entry{
+		uint64_t size, device, inode;
+		int64_t mtime; // nanoseconds
+		uint64_t name_offset;
+		uint32_t name_length, is_directory;
+	};
+	
+	std::string filename;
+	int channels = 1;
+	
+	// old store
+	const uchar* map = nullptr;
+	size_t map_size = 0;
+	std::unordered_map< std::string_view, const record* > index;
+	std::unordered_map< std::string_view, const directory* > directory_index;
+	
+	// new store
+	int fd = -1;
+	std::atomic< unsigned long > hits = 0; // images hashed from the old store
+	std::vector< record > records;
+	std::vector< directory > directories;
+	std::vector< entry > entries;
+	std::string directory_strings;
+	
+	/**
+	 * Number of bytes of a thumbnail
+	 */
+	size_t thumbnail_bytes() const{
+		return thumbnail_size * thumbnail_size * channels;
+	}
+	
+	/**
+	 * Map the old store, if it exists
+	 */
+	void load( const std::string& store_filename, int store_channels ){
+		
+		filename = store_filename;
+		channels = store_channels;
+		
+		// map the old store
+		int old_fd = ::open( filename.c_str(), O_RDONLY );
+		struct stat st;
+		
+		if( old_fd >= 0 && fstat( old_fd, &st ) == 0 &&
+			(size_t)st.st_size >= sizeof(header) ){
+			
+			void* m = mmap( nullptr, st.st_size, PROT_READ, MAP_SHARED, old_fd, 0 );
+			if( m != MAP_FAILED ){
+				map = (const uchar*)m;
+				map_size = st.st_size;
+			}
+		}
+		if( old_fd >= 0 )
+			::close( old_fd );
+		
+		// index the valid thumbnails of the old store
+		const header* h = (const header*)map;
+		if( !( map && map_size >= sizeof(header) &&
+			memcmp( h->magic, "ISCTHUMB", 8 ) == 0 &&
+			h->version == 2 && h->size == (uint32_t)thumbnail_size &&
+			h->channels == (uint32_t)channels &&
+			h->records_offset + h->count * sizeof(record) <= map_size ) ){
+			return;
+		}
+		
+		const record* r = (const record*)( map + h->records_offset );
+		for( uint64_t i = 0; i < h->count; i++ ){
+			if( r[i].valid && h->strings_offset + r[i].path_offset +
+				r[i].path_length <= map_size ){
+				index.emplace( std::string_view( (const char*)map +
+					h->strings_offset + r[i].path_offset, r[i].path_length ),
+					&r[i] );
+			}
+		}
+		
+		// index the directories whose entries are complete
+		if( h->directories_offset + h->directories_count * sizeof(directory) > map_size )
+			return;
+		
+		const directory* d = (const directory*)( map + h->directories_offset );
+		for( uint64_t i = 0; i < h->directories_count; i++ ){
+			if( h->strings_offset + d[i].path_offset + d[i].path_length <= map_size &&
+				h->entries_offset + ( d[i].first_entry + d[i].entry_count ) *
+				sizeof(entry) <= map_size ){
+				directory_index.emplace( std::string_view( (const char*)map +
+					h->strings_offset + d[i].path_offset, d[i].path_length ),
+					&d[i] );
+			}
+		}
+	}
+	
+	/**
+	 * Create the new store
+	 * 
+	 * @param count Number of images
+	 * @return false if the new store can't be created
+	 */
+	bool create( unsigned long count ){
+		
+		records.assign( count, record() );
+		fd = ::open( ( filename + ".tmp" ).c_str(),
+			O_RDWR | O_CREAT | O_TRUNC, 0644 );
+		return fd >= 0;
+	}
+	
+	/**
+	 * Get the thumbnail of an image from the old store
+	 * 
+	 * @return empty Mat if there is no thumbnail or the image was modified
+	 */
+	cv::Mat find( const std::string& image_filename,
+		const struct stat& st ) const{
+		
+		const uchar* thumbnail = find_thumbnail( image_filename, st.st_size,
+			mtime_ns( st ) );
+		if( !thumbnail )
+			return cv::Mat();
+		
+		return cv::Mat( thumbnail_size, thumbnail_size, CV_8UC(channels),
+			const_cast<uchar*>( thumbnail ) );
+	}
+	
+	/**
+	 * Get the thumbnail data of an image from the old store
+	 * 
+	 * @param mtime Modification time of the image in nanoseconds
+	 * @return nullptr if there is no thumbnail or the image was modified
+	 */
+	const uchar* find_thumbnail( const std::string& image_filename,
+		uint64_t file_size, int64_t mtime ) const{
+		
+		auto it = index.find( image_filename );
+		if( it == index.end() || it->second->file_size != file_size ||
+			it->second->mtime != mtime ){
+			return nullptr;
+		}
+		
+		return old_thumbnail( it->second );
+	}
+	
+	/**
+	 * Get the thumbnail of a record of the old store
+	 * 
+	 * @return nullptr if it is outside of the file
+	 */
+	const uchar* old_thumbnail( const record* r ) const{
+		
+		const header* h = (const header*)map;
+		size_t offset = sizeof(header) + ( r - (const record*)(
+			map + h->records_offset ) ) * thumbnail_bytes();
+		
+		return offset + thumbnail_bytes() <= map_size ? map + offset : nullptr;
+	}
+	
+	/**
+	 * Get the entries of a directory from the old store
+	 * 
+	 * @return empty if the directory is unknown or was modified
+	 */
+	std::span< const entry > find_directory( const std::string& path,
+		const struct stat& st ) const{
+		
+		auto it = directory_index.find( path );
+		if( it == directory_index.end() || it->second->mtime != mtime_ns( st ) ||
+			it->second->links != (uint64_t)st.st_nlink ){
+			return {};
+		}
+		
+		const header* h = (const header*)map;
+		return std::span< const entry >( (const entry*)( map + h->entries_offset ) +
+			it->second->first_entry, it->second->entry_count );
+	}
+	
+	/**
+	 * Name of an entry of the old store
+	 */
+	std::string_view entry_name( const entry& e ) const{
+		
+		const header* h = (const header*)map;
+		if( h->strings_offset + e.name_offset + e.name_length > map_size )
+			return {};
+		return std::string_view( (const char*)map + h->strings_offset +
+			e.name_offset, e.name_length );
+	}
+	
+	/**
+	 * Add a directory to the new store
+	 * 
+	 * @param listing Names and metadata of the entries
+	 */
+	void add_directory( const std::string& path, const struct stat& st,
+		const std::vector< std::pair< std::string, entry > >& listing ){
+		
+		directory d = {};
+		d.mtime = mtime_ns( st );
+		d.links = st.st_nlink;
+		d.path_offset = directory_strings.size();
+		d.path_length = path.size();
+		d.first_entry = entries.size();
+		d.entry_count = listing.size();
+		directory_strings += path;
+		directories.push_back( d );
+		
+		for( auto& [name, e] : listing ){
+			entries.push_back( e );
+			entries.back().name_offset = directory_strings.size();
+			entries.back().name_length = name.size();
+			directory_strings += name;
+		}
+	}
+	
+	/**
+	 * Write the thumbnail of image i to the new store (thread safe for
+	 * different i)
+	 */
+	void write( unsigned long i, const cv::Mat& thumbnail,
+		const struct stat& st ){
+		
+		cv::Mat continuous = thumbnail.isContinuous() ? thumbnail : thumbnail.clone();
+		
+		if( pwrite( fd, continuous.data, thumbnail_bytes(),
+			sizeof(header) + i * thumbnail_bytes() ) == (ssize_t)thumbnail_bytes() ){
+			records.at(i).file_size = st.st_size;
+			records.at(i).mtime = mtime_ns( st );
+			records.at(i).valid = 1;
+		}
+	}
+	
+	/**
+	 * Copy the thumbnail of image from to image to in the new store, if
+	 * it was written
+	 */
+	void copy( unsigned long from, unsigned long to ){
+		
+		if( !records.at( from ).valid )
+			return;
+		
+		std::vector< uchar > thumbnail( thumbnail_bytes() );
+		if( pread( fd, thumbnail.data(), thumbnail.size(),
+				sizeof(header) + from * thumbnail_bytes() ) == (ssize_t)thumbnail.size() &&
+			pwrite( fd, thumbnail.data(), thumbnail.size(),
+				sizeof(header) + to * thumbnail_bytes() ) == (ssize_t)thumbnail.size() ){
+			records.at( to ) = records.at( from );
+		}
+	}
+	
+	/**
+	 * Write the records and filenames and replace the old store
+	 * 
+	 * @return false on write errors
+	 */
+	bool close( const std::deque<std::string>& file_list ){
+		
+		if( fd < 0 )
+			return false;
+		
+		// the thumbnails of the old store that aren't in this file list
+		// (e.g. from another directory) are kept
+		std::vector< std::string_view > paths( file_list.begin(), file_list.end() );
+		std::unordered_set< std::string_view > listed( paths.begin(), paths.end() );
+		
+		for( auto& [path, old] : index ){
+			
+			const uchar* thumbnail = old_thumbnail( old );
+			if( listed.contains( path ) || !thumbnail )
+				continue;
+			
+			if( pwrite( fd, thumbnail, thumbnail_bytes(), sizeof(header) +
+				records.size() * thumbnail_bytes() ) == (ssize_t)thumbnail_bytes() ){
+				records.push_back( *old );
+				paths.push_back( path );
+			}
+		}
+		
+		header h = {};
+		memcpy( h.magic, "ISCTHUMB", 8 );
+		h.version = 2;
+		h.size = thumbnail_size;
+		h.channels = channels;
+		h.count = records.size();
+		h.records_offset = sizeof(header) + records.size() * thumbnail_bytes();
+		h.strings_offset = h.records_offset + records.size() * sizeof(record);
+		
+		std::string strings;
+		for( unsigned long i = 0; i < records.size(); i++ ){
+			records.at(i).path_offset = strings.size();
+			records.at(i).path_length = paths.at(i).size();
+			strings += paths.at(i);
+		}
+		
+		// the directory strings follow the filenames
+		for( auto& d : directories )
+			d.path_offset += strings.size();
+		for( auto& e : entries )
+			e.name_offset += strings.size();
+		strings += directory_strings;
+		
+		h.directories_count = directories.size();
+		h.directories_offset = h.strings_offset + ( strings.size() + 7 ) / 8 * 8;
+		h.entries_offset = h.directories_offset + directories.size() * sizeof(directory);
+		
+		bool ok = pwrite( fd, &h, sizeof(h), 0 ) == sizeof(h) &&
+			pwrite( fd, records.data(), records.size() * sizeof(record),
+				h.records_offset ) == (ssize_t)( records.size() * sizeof(record) ) &&
+			pwrite( fd, strings.data(), strings.size(),
+				h.strings_offset ) == (ssize_t)strings.size() &&
+			pwrite( fd, directories.data(), directories.size() * sizeof(directory),
+				h.directories_offset ) == (ssize_t)( directories.size() * sizeof(directory) ) &&
+			pwrite( fd, entries.data(), entries.size() * sizeof(entry),
+				h.entries_offset ) == (ssize_t)( entries.size() * sizeof(entry) );
+		
+		::close( fd );
+		fd = -1;
+		
+		if( map ){
+			munmap( const_cast<uchar*>( map ), map_size );
+			map = nullptr;
+			index.clear();
+			directory_index.clear();
+		}
+		
+		return ok && rename( ( filename + ".tmp" ).c_str(), filename.c_str() ) == 0;
+	}
+	
+	/**
+	 * Modification time in nanoseconds
+	 */
+	static int64_t mtime_ns( const struct stat& st ){
+		return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	}
+};
+
+/**
+ * Convert a 64 bit hash (PHash, AverageHash) to a single integer, bit k
+ * of the integer is bit k%8 of byte k/8
+ */
+uint64_t hash_to_bits( const cv::Mat& hash ){
+	
+	uint64_t bits = 0;
+	for( int k = 0; k < 8; k++ )
+		bits |= (uint64_t)hash.ptr<uchar>(0)[k] << ( 8*k );
+	return bits;
+}
+
+/**
+ * Convert an integer back to a 64 bit hash
+ */
+cv::Mat bits_to_hash( uint64_t bits ){
+	
+	cv::Mat hash( 1, 8, CV_8U );
+	for( int k = 0; k < 8; k++ )
+		hash.ptr<uchar>(0)[k] = bits >> ( 8*k );
+	return hash;
+}
+
+/**
+ * Calculate the PHash of all eight rotations and flips of an image from
+ * a single DCT. Flipping the image negates the odd DCT coefficients in
+ * that direction, transposing the image transposes the coefficients.
+ * 
+ * @param variants Stores the 8 hashes, variant 0 is the hash of the
+ * image itself and identical to cv::img_hash::PHash
+ */
+void calculate_dihedral_hashes( const cv::Mat& image, uint64_t* variants ){
+	
+	cv::Mat resized, gray, coefficients;
+	
+	// same steps as cv::img_hash::PHash
+	cv::resize( image, resized, cv::Size( 32, 32 ), 0, 0, cv::INTER_LINEAR_EXACT );
+	if( resized.channels() > 1 ){
+		cv::cvtColor( resized, gray, cv::COLOR_BGR2GRAY );
+	} else{
+		gray = resized;
+	}
+	gray.convertTo( gray, CV_32F );
+	cv::dct( gray, coefficients );
+	
+	// bit 0: horizontal flip, bit 1: vertical flip, bit 2: transpose
+	for( int v = 0; v < 8; v++ ){
+		
+		float c[64];
+		double sum = 0;
+		
+		for( int y = 0; y < 8; y++ ){
+			for( int x = 0; x < 8; x++ ){
+				
+				float value = ( v & 4 ) ? coefficients.at<float>( x, y ) :
+					coefficients.at<float>( y, x );
+				
+				if( ( ( v & 1 ) && ( x & 1 ) ) != ( ( v & 2 ) && ( y & 1 ) ) )
+					value = -value;
+				
+				c[y*8 + x] = value;
+				sum += value;
+			}
+		}
+		
+		// the DC coefficient is ignored
+		sum -= c[0];
+		c[0] = 0;
+		float mean = sum / 64;
+		
+		variants[v] = 0;
+		for( int k = 0; k < 64; k++ ){
+			if( c[k] > mean )
+				variants[v] |= (uint64_t)1 << k;
+		}
+	}
+}
+
+/**
+ * Get the regions of an image that are hashed for crop tolerant
+ * matching: the whole image, the centre 3/4 and 1/2 and a 4x4 grid of
+ * overlapping tiles (2/5 of the width and height, offsets of 1/5)
+ */
+std::vector< cv::Rect > image_regions( int cols, int rows ){
+	
+	std::vector< cv::Rect > regions;
+	
+	regions.emplace_back( 0, 0, cols, rows );
+	regions.emplace_back( cols/8, rows/8, cols*3/4, rows*3/4 );
+	regions.emplace_back( cols/4, rows/4, cols/2, rows/2 );
+	
+	for( int y = 0; y < 4; y++ ){
+		for( int x = 0; x < 4; x++ ){
+			regions.emplace_back( cols*x/5, rows*y/5, cols*2/5, rows*2/5 );
+		}
+	}
+	
+	return regions;
+}
+
+/**
+ * Calculate the PHash of each region of an image
+ * 
+ * @param hashes Stores num_regions hashes, 0 for regions without
+ * structure (these are not indexed)
+ */
+void calculate_region_hashes( const cv::Mat& image, uint64_t* hashes,
+	cv::Ptr<cv::img_hash::ImgHashBase> hash_func ){
+	
+	std::vector< cv::Rect > regions = image_regions( image.cols, image.rows );
+	
+	for( unsigned int r = 0; r < num_regions; r++ ){
+		
+		hashes[r] = 0;
+		
+		// regions of tiny images
+		if( regions.at(r).width < 8 || regions.at(r).height < 8 )
+			continue;
+		
+		cv::Mat region = image( regions.at(r) ), hash;
+		cv::Scalar mean, stddev;
+		
+		// flat regions (sky, background) would match everything
+		cv::meanStdDev( region, mean, stddev );
+		if( std::max( { stddev[0], stddev[1], stddev[2] } ) < region_min_stddev )
+			continue;
+		
+		hash_func->compute( region, hash );
+		hashes[r] = hash_to_bits( hash );
+	}
+}
+
+/**
+ * Index of 64 bit hashes for Hamming distance range queries (multi-index
+ * hashing). The hashes are split into radius+1 chunks, two hashes within
+ * the radius are identical in at least one chunk.
+ */
+struct hash_index{
+	
+	unsigned int num_chunks = 1;
+	
+	// one table per chunk, sorted by the chunk value
+	std::vector< std::vector< std::pair< uint64_t, unsigned long > > > tables;
+	
+	/**
+	 * Get chunk c of a hash
+	 */
+	uint64_t chunk( uint64_t hash, unsigned int c ) const{
+		
+		unsigned int begin = 64 * c / num_chunks;
+		unsigned int end = 64 * ( c+1 ) / num_chunks;
+		
+		return end - begin == 64 ? hash :
+			( hash >> begin ) & ( ( (uint64_t)1 << ( end - begin ) ) - 1 );
+	}
+	
+	/**
+	 * Build the index
+	 * 
+	 * @param hashes Hash of each id
+	 * @param ids Ids that are added to the index
+	 * @param radius Largest Hamming distance of the queries
+	 */
+	void build( const std::vector< uint64_t >& hashes,
+		const std::vector< unsigned long >& ids, unsigned int radius ){
+		
+		num_chunks = std::min( radius + 1, 64u );
+		tables.assign( num_chunks, {} );
+		
+		for( unsigned int c = 0; c < num_chunks; c++ ){
+			tables.at(c).reserve( ids.size() );
+			for( auto id : ids )
+				tables.at(c).emplace_back( chunk( hashes.at(id), c ), id );
+			std::sort( tables.at(c).begin(), tables.at(c).end() );
+		}
+	}
+	
+	/**
+	 * Call found( id ) for all ids that share a chunk with hash, ids can
+	 * be found more than once
+	 */
+	template< typename F >
+	void query( uint64_t hash, F found ) const{
+		
+		for( unsigned int c = 0; c < num_chunks; c++ ){
+			
+			auto& table = tables.at(c);
+			auto it = std::lower_bound( table.begin(), table.end(),
+				std::make_pair( chunk( hash, c ), 0UL ) );
+			
+			for( ; it != table.end() && it->first == chunk( hash, c ); ++it )
+				found( it->second );
+		}
+	}
+};
+
+/**
+ * Compare two images with all descriptors. The hashes of multi-frame
+ * images have one row per frame, these images are similar if any pair
+ * of frames is similar.
+ * 
+ * @param skip Descriptor that is not compared, -1 compares all
+ * @return true if the images are similar according to all descriptors
+ */
+bool is_similar( const std::vector< std::vector< cv::Mat > >& hash_lists,
+	const std::vector< descriptor >& descriptors,
+	std::vector< cv::Ptr<cv::img_hash::ImgHashBase> >& hash_funcs,
+	unsigned long i, unsigned long j, int skip = -1 ){
+	
+	int frames_i = hash_lists.at(0).at(i).rows;
+	int frames_j = hash_lists.at(0).at(j).rows;
+	
+	if( frames_i == 1 && frames_j == 1 ){
+		for( unsigned int d = 0; d < descriptors.size(); d++ ){
+			if( (int)d != skip && hash_funcs.at(d)->compare( hash_lists.at(d).at(i),
+				hash_lists.at(d).at(j) ) > descriptors.at(d).threshold ){
+				return false;
+			}
+		}
+		return true;
+	}
+	
+	for( int fi = 0; fi < frames_i; fi++ ){
+		for( int fj = 0; fj < frames_j; fj++ ){
+			
+			unsigned int d = 0;
+			while( d < descriptors.size() && ( (int)d == skip ||
+				hash_funcs.at(d)->compare( hash_lists.at(d).at(i).row(fi),
+				hash_lists.at(d).at(j).row(fj) ) <= descriptors.at(d).threshold ) ){
+				d++;
+			}
+			
+			if( d == descriptors.size() )
+				return true;
+		}
+	}
+	
+	return false;
+}
+
+/**
+ * Location of an image inside a zip or tar archive
+ */
+struct archive_member{
+	std::string archive; // filename of the archive
+	unsigned long archive_id; // id of the first member of the archive
+	uint64_t offset; // local file header (zip) or data (tar)
+	uint64_t size, compressed_size;
+	uint16_t method; // zip compression method, 0 stored or 8 deflated
+	bool zip;
+	bool gzip; // member of a tar archive inside a gzip stream
+};
+
+/**
+ * List the members of a zip archive from its central directory
+ * 
+ * @return false if the central directory can't be read
+ */
+bool list_zip( FILE* file, const std::string& filename,
+	std::deque<std::string>& file_list,
+	std::unordered_map< unsigned long, archive_member >& members ){
+	
+	auto le16 = []( const uchar* p ){ return (uint16_t)( p[0] | p[1] << 8 ); };
+	auto le32 = []( const uchar* p ){
+		return (uint32_t)p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+	};
+	auto le64 = [&]( const uchar* p ){ return (uint64_t)le32( p+4 ) << 32 | le32( p ); };
+	
+	// the end of central directory record is in the last 64 KiB + 22 bytes
+	if( fseeko( file, 0, SEEK_END ) != 0 )
+		return false;
+	off_t file_size = ftello( file );
+	std::vector< uchar > tail( std::min( file_size, (off_t)65557 ) );
+	
+	if( tail.size() < 22 || fseeko( file, file_size - tail.size(), SEEK_SET ) != 0 ||
+		fread( tail.data(), 1, tail.size(), file ) != tail.size() ){
+		return false;
+	}
+	
+	long end = tail.size() - 22;
+	while( end >= 0 && le32( &tail[end] ) != 0x06054b50 )
+		end--;
+	if( end < 0 )
+		return false;
+	
+	uint64_t count = le16( &tail[end+10] );
+	uint64_t directory_size = le32( &tail[end+12] );
+	uint64_t directory_offset = le32( &tail[end+16] );
+	
+	// zip64 end of central directory record
+	uchar record[56];
+	if( end >= 20 && le32( &tail[end-20] ) == 0x07064b50 &&
+		fseeko( file, le64( &tail[end-12] ), SEEK_SET ) == 0 &&
+		fread( record, 1, 56, file ) == 56 && le32( record ) == 0x06064b50 ){
+		
+		count = le64( record+32 );
+		directory_size = le64( record+40 );
+		directory_offset = le64( record+48 );
+	}
+	
+	if( directory_size > (uint64_t)file_size )
+		return false;
+	
+	std::vector< uchar > directory( directory_size );
+	if( fseeko( file, directory_offset, SEEK_SET ) != 0 ||
+		fread( directory.data(), 1, directory.size(), file ) != directory.size() ){
+		return false;
+	}
+	
+	unsigned long archive_id = file_list.size();
+	size_t position = 0;
+	
+	for( uint64_t n = 0; n < count && position + 46 <= directory.size() &&
+		le32( &directory[position] ) == 0x02014b50; n++ ){
+		
+		const uchar* entry = &directory[position];
+		uint16_t flags = le16( entry+8 ), method = le16( entry+10 );
+		uint64_t compressed_size = le32( entry+20 ), size = le32( entry+24 );
+		uint64_t offset = le32( entry+42 );
+		size_t name_length = le16( entry+28 ), extra_length = le16( entry+30 );
+		
+		if( position + 46 + name_length + extra_length > directory.size() )
+			break;
+		
+		std::string name( (const char*)entry + 46, name_length );
+		
+		// the zip64 extra field contains the values that don't fit
+		for( size_t e = 46 + name_length; e + 4 <= 46 + name_length + extra_length;
+			e += 4 + le16( entry+e+2 ) ){
+			
+			const uchar* value = entry+e+4;
+			const uchar* value_end = value + le16( entry+e+2 );
+			if( le16( entry+e ) != 0x0001 )
+				continue;
+			
+			for( uint64_t* field : { &size, &compressed_size, &offset } ){
+				if( *field == 0xffffffff && value + 8 <= value_end ){
+					*field = le64( value );
+					value += 8;
+				}
+			}
+		}
+		
+		position += 46 + name_length + extra_length + le16( entry+32 );
+		
+		// directories, encrypted members and other compression methods
+		// are skipped
+		if( name.empty() || name.back() == '/' || ( flags & 1 ) ||
+			size > max_member_size || compressed_size > max_member_size ){
+			continue;
+		}
+#ifdef HAVE_ZLIB
+		if( method != 0 && method != 8 )
+			continue;
+#else
+		if( method != 0 )
+			continue;
+#endif
+		
+		// deflate compresses at most about 1032:1 and stored members have
+		// their size twice, other sizes in the directory are damaged
+		if( method == 0 ? size != compressed_size : size / 1032 > compressed_size )
+			continue;
+		
+		members.emplace( file_list.size(), archive_member{ filename, archive_id,
+			offset, size, compressed_size, method, true, false } );
+		file_list.push_back( filename + archive_separator + name );
+	}
+	
+	return true;
+}
+
+/**
+ * List the regular files of a tar archive (ustar, GNU and pax names)
+ * 
+ * @param gzip The archive is compressed with gzip
+ * @return false if the archive can't be read
+ */
+bool list_tar( FILE* file, const std::string& filename, bool gzip,
+	std::deque<std::string>& file_list,
+	std::unordered_map< unsigned long, archive_member >& members ){
+	
+#ifdef HAVE_ZLIB
+	gzFile gz = gzip ? gzopen( filename.c_str(), "rb" ) : nullptr;
+	if( gzip && !gz )
+		return false;
+	
+	auto read = [&]( void* buffer, size_t size ){
+		return gzip ? gzread( gz, buffer, size ) == (int)size :
+			fread( buffer, 1, size, file ) == size;
+	};
+	auto skip = [&]( uint64_t size ){
+		return gzip ? gzseek( gz, size, SEEK_CUR ) != -1 :
+			fseeko( file, size, SEEK_CUR ) == 0;
+	};
+#else
+	if( gzip )
+		return false;
+	
+	auto read = [&]( void* buffer, size_t size ){
+		return fread( buffer, 1, size, file ) == size;
+	};
+	auto skip = [&]( uint64_t size ){
+		return fseeko( file, size, SEEK_CUR ) == 0;
+	};
+#endif
+	
+	if( !gzip && fseeko( file, 0, SEEK_SET ) != 0 )
+		return false;
+	
+	uchar block[512];
+	unsigned long archive_id = file_list.size();
+	uint64_t position = 0;
+	std::string long_name;
+	
+	while( read( block, 512 ) && block[0] != 0 ){
+		
+		position += 512;
+		
+		// the size is octal or base-256 for large files
+		uint64_t size = 0;
+		if( block[124] & 0x80 ){
+			for( int k = 128; k < 136; k++ )
+				size = size << 8 | block[k];
+		} else{
+			size = strtoull( std::string( (const char*)block+124, 12 ).c_str(),
+				nullptr, 8 );
+		}
+		uint64_t padded = ( size + 511 ) / 512 * 512;
+		char type = block[156];
+		
+		std::string name = long_name;
+		if( name.empty() ){
+			name.assign( (const char*)block, strnlen( (const char*)block, 100 ) );
+			if( memcmp( block+257, "ustar", 5 ) == 0 && block[345] ){
+				name = std::string( (const char*)block+345,
+					strnlen( (const char*)block+345, 155 ) ) + "/" + name;
+			}
+		}
+		long_name.clear();
+		
+		if( ( type == 'L' || type == 'x' ) && size <= 1 << 20 ){
+			
+			// the name of the next member (GNU) or its pax header
+			std::string data( padded, '\0' );
+			if( !read( data.data(), padded ) )
+				break;
+			position += padded;
+			
+			if( type == 'L' ){
+				long_name = data.c_str();
+			} else{
+				// records are "length path=value\n"
+				for( size_t r = 0; r < size; ){
+					size_t length = strtoul( data.c_str() + r, nullptr, 10 );
+					size_t key = data.find( ' ', r );
+					if( length == 0 || key == std::string::npos || r + length > size )
+						break;
+					if( data.compare( key + 1, 5, "path=" ) == 0 )
+						long_name = data.substr( key + 6, r + length - key - 7 );
+					r += length;
+				}
+			}
+			continue;
+		}
+		
+		if( ( type == '0' || type == '\0' ) && size <= max_member_size &&
+			!name.empty() && name.back() != '/' ){
+			
+			members.emplace( file_list.size(), archive_member{ filename, archive_id,
+				position, size, size, 0, false, gzip } );
+			file_list.push_back( filename + archive_separator + name );
+		}
+		
+		if( !skip( padded ) )
+			break;
+		position += padded;
+	}
+	
+#ifdef HAVE_ZLIB
+	if( gz )
+		gzclose( gz );
+#endif
+	
+	return true;
+}
+
+/**
+ * Add the members of a zip, tar or tar.gz archive to file_list, the
+ * members are named archive!/path
+ * 
+ * @return false if the file is not an archive
+ */
+bool list_archive( const std::string& filename, std::deque<std::string>& file_list,
+	std::unordered_map< unsigned long, archive_member >& members ){
+	
+	std::string lower = filename;
+	std::transform( lower.begin(), lower.end(), lower.begin(),
+		[]( unsigned char c ){ return std::tolower( c ); } );
+	auto ends_with = [&]( const std::string& suffix ){
+		return lower.size() >= suffix.size() &&
+			lower.compare( lower.size() - suffix.size(), suffix.size(), suffix ) == 0;
+	};
+	
+	bool zip = ends_with( ".zip" ), tar = ends_with( ".tar" );
+	bool gzip = ends_with( ".tar.gz" ) || ends_with( ".tgz" );
+	if( !zip && !tar && !gzip )
+		return false;
+	
+	FILE* file = fopen( filename.c_str(), "rb" );
+	if( !file )
+		return false;
+	
+	bool result = zip ? list_zip( file, filename, file_list, members ) :
+		list_tar( file, filename, gzip, file_list, members );
+	
+	fclose( file );
+	return result;
+}
+
+/**
+ * Reads the data of archive members, the gzip stream of the last tar.gz
+ * archive stays open because its members are read in order
+ */
+struct archive_reader{
+	
+#ifdef HAVE_ZLIB
+	gzFile gz = nullptr;
+	std::string gz_archive;
+	
+	~archive_reader(){
+		if( gz )
+			gzclose( gz );
+	}
+#endif
+	
+	/**
+	 * Read and decompress a member
+	 * 
+	 * @return false on errors
+	 */
+	bool read( const archive_member& member, std::vector< uchar >& data ){
+		
+		data.resize( member.size );
+		
+		if( member.gzip ){
+#ifdef HAVE_ZLIB
+			if( !gz || gz_archive != member.archive ){
+				if( gz )
+					gzclose( gz );
+				gz = gzopen( member.archive.c_str(), "rb" );
+				gz_archive = member.archive;
+			}
+			
+			// seeking forward decompresses up to the member
+			return gz && gzseek( gz, member.offset, SEEK_SET ) == (z_off_t)member.offset &&
+				gzread( gz, data.data(), data.size() ) == (int)data.size();
+#else
+			return false;
+#endif
+		}
+		
+		FILE* file = fopen( member.archive.c_str(), "rb" );
+		if( !file )
+			return false;
+		
+		// the data of zip members follows the local file header
+		uint64_t offset = member.offset;
+		uchar header[30];
+		bool success = true;
+		
+		if( member.zip ){
+			success = fseeko( file, offset, SEEK_SET ) == 0 &&
+				fread( header, 1, 30, file ) == 30 &&
+				memcmp( header, "PK\x03\x04", 4 ) == 0;
+			offset += 30 + ( header[26] | header[27] << 8 ) +
+				( header[28] | header[29] << 8 );
+		}
+		
+		std::vector< uchar > compressed( member.method == 8 ? member.compressed_size : 0 );
+		std::vector< uchar >& buffer = member.method == 8 ? compressed : data;
+		
+		success = success && fseeko( file, offset, SEEK_SET ) == 0 &&
+			fread( buffer.data(), 1, buffer.size(), file ) == buffer.size();
+		fclose( file );
+		
+#ifdef HAVE_ZLIB
+		if( success && member.method == 8 ){
+			
+			// raw deflate stream without zlib header
+			z_stream stream = {};
+			stream.next_in = compressed.data();
+			stream.avail_in = compressed.size();
+			stream.next_out = data.data();
+			stream.avail_out = data.size();
+			
+			success = inflateInit2( &stream, -MAX_WBITS ) == Z_OK;
+			if( success ){
+				success = inflate( &stream, Z_FINISH ) == Z_STREAM_END;
+				inflateEnd( &stream );
+			}
+		}
+#endif
+		
+		return success;
+	}
+};
+
+/**
+ * Give the kernel advice (posix_fadvise) about the future use of a
+ * whole file
+ */
+void advise_file( const std::string& filename, int advice ){
+	
+	int fd = open( filename.c_str(), O_RDONLY );
+	if( fd < 0 )
+		return;
+	
+	posix_fadvise( fd, 0, 0, advice );
+	close( fd );
+}
+
+/**
+ * Read a whole file with O_DIRECT, which bypasses the page cache
+ * 
+ * @param buffer Buffer of direct_chunk_size bytes aligned to
+ * direct_alignment
+ * @return false if the file can't be read this way (e.g. the file system
+ * doesn't support O_DIRECT or the file is too large)
+ */
+bool read_file_direct( const std::string& filename, uchar* buffer,
+	std::vector< uchar >& data ){
+	
+	int fd = open( filename.c_str(), O_RDONLY | O_DIRECT );
+	if( fd < 0 )
+		return false;
+	
+	struct stat st;
+	if( fstat( fd, &st ) != 0 || st.st_size > max_direct_size ){
+		close( fd );
+		return false;
+	}
+	
+	data.clear();
+	data.reserve( st.st_size );
+	
+	// only the last read at the end of the file is short
+	ssize_t n;
+	while( ( n = read( fd, buffer, direct_chunk_size ) ) > 0 ){
+		data.insert( data.end(), buffer, buffer + n );
+		if( n < (ssize_t)direct_chunk_size )
+			break;
+	}
+	
+	close( fd );
+	return n >= 0 && data.size() == (size_t)st.st_size;
+}
+
+/**
+ * Metadata of a file from the creation of the file list, all values are
+ * 0 if the file couldn't be stat()ed or is an archive member
+ */
+struct file_info{
+	uint64_t size = 0;
+	dev_t device = 0;
+	ino_t inode = 0;
+	int64_t mtime = 0; // nanoseconds
+	bool cached = false; // from the store listing of an unchanged directory
+};
+
+/**
+ * Order in which the images are hashed. Each job is one image or all
+ * members of a tar.gz archive, which are read in order by one thread.
+ * The jobs are either distributed statically over the threads or, in
+ * the largest first order, taken by the next free thread.
+ */
+struct hash_schedule{
+	
+	std::vector< unsigned long > order; // images in the order of the jobs
+	std::vector< unsigned long > jobs; // first position in order of each job, and order.size()
+	std::vector< bool > stored; // images with a stored thumbnail, by index
+	bool dynamic = false;
+	std::atomic< unsigned long > next_job = 0;
+	
+	/**
+	 * Create the jobs of all images that are not skipped
+	 * 
+	 * @param skipped Images that aren't hashed, if not empty
+	 * @param files Sizes of the images
+	 * @param store Images with a stored thumbnail count as size 0
+	 * @param largest_first Dispatch the largest jobs first
+	 */
+	hash_schedule( const std::deque< std::string >& file_list,
+		const std::vector< bool >& skipped,
+		const std::unordered_map< unsigned long, archive_member >& archive_members,
+		const std::vector< file_info >& files, const thumbnail_store& store,
+		bool largest_first ){
+		
+		std::vector< uint64_t > job_sizes;
+		stored.resize( file_list.size() );
+		
+		for( unsigned long i = 0; i < file_list.size(); i++ ){
+			
+			if( !skipped.empty() && skipped.at(i) )
+				continue;
+			
+			auto member = archive_members.find( i );
+			bool in_archive = member != archive_members.end();
+			uint64_t size = in_archive ? member->second.compressed_size :
+				files.at(i).size;
+			
+			// images in the store are not decoded
+			if( !in_archive && store.find_thumbnail( file_list.at(i),
+				files.at(i).size, files.at(i).mtime ) ){
+				stored.at(i) = true;
+				size = 0;
+			}
+			
+			// the following members of a tar.gz archive join its job
+			if( in_archive && member->second.gzip && !order.empty() ){
+				auto last = archive_members.find( order.back() );
+				if( last != archive_members.end() && last->second.gzip &&
+					last->second.archive_id == member->second.archive_id ){
+					order.push_back(i);
+					job_sizes.back() += size;
+					continue;
+				}
+			}
+			
+			jobs.push_back( order.size() );
+			order.push_back(i);
+			job_sizes.push_back( size );
+		}
+		
+		if( largest_first ){
+			
+			// sort the jobs by size, their images stay in order
+			std::vector< unsigned long > sorted( jobs.size() );
+			for( unsigned long j = 0; j < jobs.size(); j++ )
+				sorted.at(j) = j;
+			std::stable_sort( sorted.begin(), sorted.end(),
+				[&]( unsigned long a, unsigned long b ){
+					return job_sizes.at(a) > job_sizes.at(b);
+				} );
+			
+			std::vector< unsigned long > sorted_order, sorted_jobs;
+			sorted_order.reserve( order.size() );
+			for( unsigned long j : sorted ){
+				sorted_jobs.push_back( sorted_order.size() );
+				unsigned long end = j+1 < jobs.size() ? jobs.at(j+1) : order.size();
+				sorted_order.insert( sorted_order.end(), order.begin() + jobs.at(j),
+					order.begin() + end );
+			}
+			
+			order.swap( sorted_order );
+			jobs.swap( sorted_jobs );
+			dynamic = true;
+		}
+		
+		jobs.push_back( order.size() );
+	}
+	
+	/**
+	 * Position of a thread in the schedule
+	 */
+	struct cursor{
+		
+		hash_schedule& schedule;
+		unsigned int thread_id, num_threads;
+		unsigned long job = ULONG_MAX, position = 0;
+		
+		/**
+		 * Get the next image of this thread
+		 * 
+		 * @return false if all jobs are taken
+		 */
+		bool next( unsigned long& image ){
+			
+			if( job != ULONG_MAX && ++position < schedule.jobs.at( job+1 ) ){
+				image = schedule.order.at( position );
+				return true;
+			}
+			
+			if( schedule.dynamic ){
+				job = schedule.next_job++;
+			} else{
+				job = job == ULONG_MAX ? thread_id : job + num_threads;
+			}
+			
+			if( job+1 >= schedule.jobs.size() ){
+				job = schedule.jobs.size();
+				return false;
+			}
+			
+			position = schedule.jobs.at( job );
+			image = schedule.order.at( position );
+			return true;
+		}
+		
+		/**
+		 * Get the first image of a job that this thread likely takes
+		 * later, ahead rounds of the threads after the current job
+		 * 
+		 * @return false if there is no such job
+		 */
+		bool peek( unsigned int ahead, unsigned long& image, unsigned long& ahead_job ) const{
+			
+			ahead_job = job + ahead * num_threads;
+			if( ahead_job+1 >= schedule.jobs.size() )
+				return false;
+			
+			image = schedule.order.at( schedule.jobs.at( ahead_job ) );
+			return true;
+		}
+	};
+};
+
+/**
+ * Calculate the descriptors of the images, all descriptors are calculated
+ * from a single decode and a shared reduced image
+ * 
+ * @param file_list List of filenames for all images
+ * @param schedule Order of the images, images that aren't in it are skipped
+ * @param files Metadata of the images from the file list
+ * @param descriptors Descriptors to calculate
+ * @param hash_lists Stores the hash values, one list per descriptor
+ * @param timestamps Stores the capture times, if not empty
+ * @param store Thumbnail store, if open the hashes are calculated from
+ * the thumbnails
+ * @param dihedral_lists Stores eight PHash variants per image, if not empty
+ * @param region_lists Stores num_regions hashes per image, if not empty
+ * @param frames Frames of multi-frame images, their hashes are stored as
+ * one row per frame
+ * @param archive_members Images in archives by their id
+ * @param thread_id Number of the particular thread
+ * @param num_threads Total number of threads
+ */
+void calculate_hash_values( const std::deque<std::string>& file_list, 
+	hash_schedule& schedule, const std::vector< file_info >& files,
+	const std::vector< descriptor >& descriptors,
+	std::vector< std::vector< cv::Mat > >& hash_lists,
+	std::vector< long long >& timestamps, thumbnail_store& store,
+	std::vector< uint64_t >& dihedral_lists,
+	std::vector< uint64_t >& region_lists, const frame_selection& frames,
+	const std::unordered_map< unsigned long, archive_member >& archive_members,
+	unsigned int thread_id, unsigned int num_threads ){
+
+	std::vector< cv::Ptr<cv::img_hash::ImgHashBase> > hash_funcs =
+		create_hash_funcs( descriptors );
+	cv::Ptr<cv::img_hash::ImgHashBase> region_hash_func =
+		cv::img_hash::PHash::create();
+	
+	// the regions need a larger image than most descriptors
+	int input_size = descriptor_input_size( descriptors );
+	if( !region_lists.empty() )
+		input_size = std::max( input_size, region_input_size );
+	
+	// reads the members of archives
+	archive_reader reader;
+	
+	// decodes the images with -T
+	decode_worker worker;
+	
+	// block aligned buffer for the O_DIRECT reads
+	std::vector< uchar > direct_storage( page_cache == cache_direct ?
+		direct_chunk_size + direct_alignment : 0 );
+	uchar* direct_buffer = direct_storage.data() +
+		( -(uintptr_t)direct_storage.data() & ( direct_alignment - 1 ) );
+	
+	// the last hashed file, it is dropped from the page cache
+	const std::string* previous = nullptr;
+	
+	// the last job that was prefetched
+	unsigned long prefetched = 0;
+	
+	// bytes read by this thread when the current image was started
+	unsigned long long last_bytes_read = read_limit.rate > 0 ? thread_bytes_read() : 0;
+	
+	// the buffers of the current archive member, reserved from decode_budget
+	unsigned long long member_reserved = 0;
+	
+	// iterate over the images of this thread
+	hash_schedule::cursor cursor{ schedule, thread_id, num_threads };
+	for( unsigned long i; cursor.next(i); ){
+		
+		auto member = archive_members.find( i );
+		bool in_archive = member != archive_members.end();
+		
+		if( previous ){
+			advise_file( *previous, POSIX_FADV_DONTNEED );
+			previous = nullptr;
+		}
+		
+		decode_budget.release( member_reserved );
+		member_reserved = 0;
+		
+		// the bytes read for the previous image are taken from read_limit,
+		// the replies of the decode worker are taken as its bytes_read instead
+		if( read_limit.rate > 0 ){
+			unsigned long long bytes_read = thread_bytes_read() - worker.received;
+			read_limit.take( bytes_read - std::min( bytes_read, last_bytes_read ) );
+			last_bytes_read = bytes_read;
+		}
+		
+		// every image and archive member that is read counts as an opened
+		// file, with -s an image that is only stat()ed is counted if its
+		// thumbnail isn't stored
+		bool opened = store.fd < 0 || in_archive || !timestamps.empty() ||
+			frames.count != 1 ||
+			( frames.video_interval > 0 && is_video_file( file_list.at(i) ) );
+		if( opened )
+			open_limit.take( 1 );
+		
+		// images with a stored thumbnail are only stat()ed
+		if( page_cache != cache_default && !in_archive && !schedule.stored.at(i) )
+			previous = &file_list.at(i);
+		
+		// the next files of this thread are read in the background
+		for( unsigned int k = 1; page_cache == cache_dontneed && k <= prefetch_files; k++ ){
+			unsigned long j, job;
+			if( cursor.peek( k, j, job ) && job > prefetched &&
+				!archive_members.contains(j) && !schedule.stored.at(j) ){
+				advise_file( file_list.at(j), POSIX_FADV_WILLNEED );
+				prefetched = job;
+			}
+		}
+		
+		cv::Mat current_image;
+		image_header header;
+		std::vector< uchar > file_data;
+		
+		if( in_archive ){
+			
+			// members of archives are read into memory and decoded from there,
+			// deflated members need the compressed data too while reading
+			member_reserved = decode_budget.reserve( member->second.size +
+				( member->second.method == 8 ? member->second.compressed_size : 0 ) );
+			
+			if( !reader.read( member->second, file_data ) || file_data.empty() )
+				continue;
+			
+			FILE* memory = fmemopen( file_data.data(), file_data.size(), "rb" );
+			if( !memory )
+				continue;
+			
+			if( !timestamps.empty() )
+				timestamps.at(i) = read_exif_timestamp( memory );
+			if( !read_image_header( memory, header ) )
+				header = image_header();
+			fclose( memory );
+			
+		} else if( !timestamps.empty() ){
+			// read capture time from the header
+			timestamps.at(i) = read_exif_timestamp( file_list.at(i) );
+		}
+		
+		// multi-frame images and videos are decoded frame by frame and not
+		// stored
+		std::vector< cv::Mat > frame_images;
+		
+		if( !in_archive && frames.count != 1 && read_image_header( file_list.at(i), header ) &&
+			( header.format == format_gif || header.format == format_tiff ) &&
+			!( max_decode_pixels && header.width * header.height > max_decode_pixels ) ){
+			frame_images = decode_frames( file_list.at(i), header, frames,
+				store.fd >= 0 ? thumbnail_size : input_size );
+		} else if( !in_archive && frames.video_interval > 0 &&
+			is_video_file( file_list.at(i) ) ){
+			frame_images = decode_video_frames( file_list.at(i), frames.video_interval,
+				store.fd >= 0 ? thumbnail_size : input_size );
+			if( frame_images.empty() )
+				continue;
+		}
+		
+		if( !frame_images.empty() ){
+			
+			for( auto& frame : frame_images ){
+				if( store.fd >= 0 )
+					frame = make_thumbnail( frame, store.channels );
+				apply_orientation( frame, header.orientation );
+			}
+			
+			for( unsigned int d = 0; d < descriptors.size(); d++ ){
+				
+				std::vector< cv::Mat > frame_hashes( frame_images.size() );
+				for( unsigned int f = 0; f < frame_images.size(); f++ )
+					hash_funcs.at(d)->compute( frame_images.at(f), frame_hashes.at(f) );
+				
+				cv::vconcat( frame_hashes, hash_lists.at(d).at(i) );
+			}
+			continue;
+		}
+		
+		// use the stored thumbnail of unchanged images
+		struct stat st;
+		bool stored = false;
+		
+		if( store.fd >= 0 && !in_archive ){
+			
+			// files of unchanged directories (-u) aren't stat()ed again
+			if( files.at(i).cached ){
+				st = {};
+				st.st_size = files.at(i).size;
+				st.st_mtim.tv_sec = files.at(i).mtime / 1000000000;
+				st.st_mtim.tv_nsec = files.at(i).mtime % 1000000000;
+			} else if( stat( file_list.at(i).c_str(), &st ) != 0 ){
+				continue;
+			}
+			
+			current_image = store.find( file_list.at(i), st );
+			stored = current_image.data;
+		}
+		
+		// read image, the EXIF orientation is applied after reducing it
+		unsigned int orientation = 1;
+		
+		if( !current_image.data ){
+			
+			if( !opened )
+				open_limit.take( 1 );
+			
+			if( !in_archive && !read_image_header( file_list.at(i), header ) )
+				header = image_header();
+			
+			// pathological images are reported instead of hashed
+			if( max_decode_pixels && header.width * header.height > max_decode_pixels ){
+				report_skipped( file_list.at(i), "exceeds the pixel limit" );
+				continue;
+			}
+			
+			// read the whole file past the page cache
+			bool in_memory = in_archive || ( page_cache == cache_direct &&
+				read_file_direct( file_list.at(i), direct_buffer, file_data ) );
+			
+			if( max_decode_seconds > 0 ){
+				bool timed_out;
+				current_image = decode_image_in_worker( worker, file_list.at(i), header,
+					store.fd >= 0 ? thumbnail_size : input_size,
+					in_memory ? &file_data : nullptr, timed_out );
+				if( timed_out ){
+					report_skipped( file_list.at(i), "exceeds the time limit" );
+					continue;
+				}
+			} else{
+				current_image = decode_image( file_list.at(i), header,
+					store.fd >= 0 ? thumbnail_size : input_size,
+					in_memory ? &file_data : nullptr );
+			}
+			orientation = header.orientation;
+		}
+		
+		// check for image data
+		if( !current_image.data )
+			continue;
+		
+		// all hashes are calculated from the thumbnail
+		if( store.fd >= 0 && !stored )
+			current_image = make_thumbnail( current_image, store.channels );
+		
+		apply_orientation( current_image, orientation );
+		
+		// stored thumbnails are copied to the new store as they are
+		if( store.fd >= 0 && !in_archive )
+			store.write( i, current_image, st );
+		
+		if( stored )
+			store.hits++;
+		
+		// hashes of the regions for crop tolerant matching
+		if( !region_lists.empty() ){
+			calculate_region_hashes( current_image,
+				&region_lists.at( i*num_regions ), region_hash_func );
+		}
+		
+		// all rotations and flips from one DCT
+		if( !dihedral_lists.empty() )
+			calculate_dihedral_hashes( current_image, &dihedral_lists.at( i*8 ) );
+		
+		// calculate and store hashes
+		for( unsigned int d = 0; d < descriptors.size(); d++ ){
+			
+			cv::Mat current_hash;
+			
+			if( !dihedral_lists.empty() && descriptors.at(d).name == "phash" ){
+				current_hash = bits_to_hash( dihedral_lists.at( i*8 ) );
+			} else{
+				hash_funcs.at(d)->compute( current_image, current_hash );
+			}
+			
+			hash_lists.at(d).at(i) = current_hash;
+		}
+	}
+	
+	decode_budget.release( member_reserved );
+	stop_decode_worker( worker );
+	
+	if( previous )
+		advise_file( *previous, POSIX_FADV_DONTNEED );
+}
+
+/**
+ * Store a similar pair of images
+ */
+void add_similar_pair(
+	std::map< unsigned long, std::set< unsigned long > >& image_similarities,
+	unsigned long i, unsigned long j ){
+	
+	mu.lock();
+	if(!image_similarities.contains(i)){
+		image_similarities.emplace(i, std::set<unsigned long>());
+	}
+	image_similarities.at(i).emplace(j);
+	mu.unlock();
+}
+
+/**
+ * Calculate all similar pairs of images
+ * 
+ * If query_begin is not 0, the images before query_begin are the
+ * reference set and the images starting at query_begin are the query
+ * set. Only pairs of a query image and a reference image are compared.
+ * 
+ * @param hash_lists Lists of all hash values, one list per descriptor
+ * @param descriptors Descriptors and their thresholds
+ * @param similar_pairs Stores the similar pairs
+ * @param query_begin Index of the first query image, 0 compares all pairs
+ * @param thread_id Number of the particular thread
+ * @param num_threads Total number of threads
+ */
+void calculate_similar_pairs(
+	const std::vector< std::vector< cv::Mat > >& hash_lists,
+	const std::vector< descriptor >& descriptors,
+	std::map< unsigned long, std::set< unsigned long > >& image_similarities,
+	unsigned long query_begin,
+	unsigned int thread_id, unsigned int num_threads ){
+	
+	// hash functions used for comparison of two hashes
+	std::vector< cv::Ptr<cv::img_hash::ImgHashBase> > hash_funcs =
+		create_hash_funcs( descriptors );
+	const std::vector< cv::Mat >& hash_list = hash_lists.at(0);
+
+	// iterate over hash_list (or the query set)
+	for( unsigned long i = query_begin; i < hash_list.size(); i++ ){
+		
+		// check if correct thread for image
+		if( i%num_threads != thread_id )
+			continue;
+		
+		if( !hash_list.at(i).data )
+			continue;
+		
+		// compare against the reference set or all following images
+		unsigned long j_begin = query_begin ? 0 : i+1;
+		unsigned long j_end = query_begin ? query_begin : hash_list.size();
+		
+		for( unsigned long j = j_begin; j < j_end; ++j ){
+			if( !hash_list.at(j).data )
+				continue;
+
+			if( is_similar( hash_lists, descriptors, hash_funcs, i, j ) ){
+				add_similar_pair( image_similarities, i, j );
+			}
+		}
+		
+	}
+}
+
+/**
+ * Calculate all similar pairs of images whose capture times are at most
+ * window seconds apart. Images without capture time are compared to all
+ * images.
+ * 
+ * @param hash_lists Lists of all hash values, one list per descriptor
+ * @param descriptors Descriptors and their thresholds
+ * @param timestamps Capture times of all images
+ * @param time_order Ids of the images with capture time, sorted by time
+ * @param time_rank Position of each image in time_order
+ * @param similar_pairs Stores the similar pairs
+ * @param window Maximum difference of the capture times in seconds
+ * @param query_begin Index of the first query image, 0 compares all pairs
+ * @param thread_id Number of the particular thread
+ * @param num_threads Total number of threads
+ */
+void calculate_similar_pairs_in_window(
+	const std::vector< std::vector< cv::Mat > >& hash_lists,
+	const std::vector< descriptor >& descriptors,
+	const std::vector< long long >& timestamps,
+	const std::vector< unsigned long >& time_order,
+	const std::vector< unsigned long >& time_rank,
+	std::map< unsigned long, std::set< unsigned long > >& image_similarities,
+	long long window, unsigned long query_begin,
+	unsigned int thread_id, unsigned int num_threads ){
+	
+	// hash functions used for comparison of two hashes
+	std::vector< cv::Ptr<cv::img_hash::ImgHashBase> > hash_funcs =
+		create_hash_funcs( descriptors );
+	const std::vector< cv::Mat >& hash_list = hash_lists.at(0);
+	
+	// compare i and j if they are from different sets in the bipartite mode
+	auto compare = [&]( unsigned long i, unsigned long j ){
+		
+		if( query_begin && ( i < query_begin ) == ( j < query_begin ) )
+			return;
+		
+		if( !hash_list.at(j).data )
+			return;
+		
+		if( is_similar( hash_lists, descriptors, hash_funcs, i, j ) )
+			add_similar_pair( image_similarities, std::max( i, j ), std::min( i, j ) );
+	};
+	
+	// iterate over hash_list
+	for( unsigned long i = 0; i < hash_list.size(); i++ ){
+		
+		// check if correct thread for image
+		if( i%num_threads != thread_id )
+			continue;
+		
+		if( !hash_list.at(i).data )
+			continue;
+		
+		if( timestamps.at(i) == no_timestamp ){
+			
+			// full search, pairs of images without capture time are
+			// only compared once
+			for( unsigned long j = 0; j < hash_list.size(); ++j ){
+				if( j != i && ( timestamps.at(j) != no_timestamp || j > i ) )
+					compare( i, j );
+			}
+			
+		} else{
+			
+			// sweep over the following images inside the window
+			for( unsigned long k = time_rank.at(i) + 1; k < time_order.size() &&
+				timestamps.at( time_order.at(k) ) - timestamps.at(i) <= window; ++k ){
+				compare( i, time_order.at(k) );
+			}
+			
+		}
+		
+	}
+}
+
+/**
+ * Calculate all similar pairs of images, including rotated and flipped
+ * images. Candidates are found with the hash index and the phash
+ * descriptor is compared with all eight variants of each image.
+ * 
+ * If exact is true, the index contains the canonical variant (the
+ * smallest of the eight) of each image, which needs a single query per
+ * image.
+ * 
+ * @param hash_lists Lists of all hash values, one list per descriptor
+ * @param descriptors Descriptors and their thresholds
+ * @param dihedral_lists Eight PHash variants per image
+ * @param index Index of the variant 0 (or canonical) hashes
+ * @param exact Only identical hashes are similar
+ * @param timestamps Capture times, only images at most window seconds
+ * apart are similar, if not empty
+ * @param window Maximum difference of the capture times in seconds
+ * @param similar_pairs Stores the similar pairs
+ * @param query_begin Index of the first query image, 0 compares all pairs
+ * @param thread_id Number of the particular thread
+ * @param num_threads Total number of threads
+ */
+void calculate_similar_pairs_dihedral(
+	const std::vector< std::vector< cv::Mat > >& hash_lists,
+	const std::vector< descriptor >& descriptors,
+	const std::vector< uint64_t >& dihedral_lists,
+	const hash_index& index, bool exact,
+	const std::vector< long long >& timestamps, long long window,
+	std::map< unsigned long, std::set< unsigned long > >& image_similarities,
+	unsigned long query_begin,
+	unsigned int thread_id, unsigned int num_threads ){
+	
+	// hash functions used for comparison of two hashes
+	std::vector< cv::Ptr<cv::img_hash::ImgHashBase> > hash_funcs =
+		create_hash_funcs( descriptors );
+	const std::vector< cv::Mat >& hash_list = hash_lists.at(0);
+	
+	// the phash descriptor is compared with the variants
+	unsigned int phash = 0;
+	while( descriptors.at(phash).name != "phash" )
+		phash++;
+	double threshold = descriptors.at(phash).threshold;
+	
+	// marks the candidates that were already checked for image i
+	std::vector< unsigned long > checked( hash_list.size(), 0 );
+	
+	// iterate over hash_list (or the query set)
+	for( unsigned long i = query_begin; i < hash_list.size(); i++ ){
+		
+		// check if correct thread for image
+		if( i%num_threads != thread_id )
+			continue;
+		
+		if( !hash_list.at(i).data )
+			continue;
+		
+		const uint64_t* variants = &dihedral_lists.at( i*8 );
+		
+		auto check = [&]( unsigned long j ){
+			
+			if( j == i || checked.at(j) == i+1 )
+				return;
+			checked.at(j) = i+1;
+			
+			if( !timestamps.empty() && timestamps.at(i) != no_timestamp &&
+				timestamps.at(j) != no_timestamp &&
+				std::abs( timestamps.at(i) - timestamps.at(j) ) > window ){
+				return;
+			}
+			
+			// closest variant
+			bool similar = exact;
+			for( int v = 0; v < 8 && !similar; v++ ){
+				similar = __builtin_popcountll( variants[v] ^
+					dihedral_lists.at( j*8 ) ) <= threshold;
+			}
+			
+			if( similar && is_similar( hash_lists, descriptors, hash_funcs,
+				i, j, phash ) ){
+				add_similar_pair( image_similarities, std::max( i, j ),
+					std::min( i, j ) );
+			}
+		};
+		
+		if( exact ){
+			index.query( *std::min_element( variants, variants+8 ), check );
+		} else{
+			for( int v = 0; v < 8; v++ )
+				index.query( variants[v], check );
+		}
+		
+	}
+}
+
+/**
+ * Calculate all similar pairs of images from their region hashes, two
+ * images are similar if at least min_votes regions of one image match a
+ * region of the other image. The votes are counted in a flat array.
+ * 
+ * @param hash_lists Lists of all hash values, used to skip unreadable images
+ * @param region_lists num_regions hashes per image
+ * @param index Index of the region hashes (ids are image*num_regions+region)
+ * @param radius Largest Hamming distance of matching regions
+ * @param min_votes Number of matching regions of similar images
+ * @param timestamps Capture times, only images at most window seconds
+ * apart are similar, if not empty
+ * @param window Maximum difference of the capture times in seconds
+ * @param similar_pairs Stores the similar pairs
+ * @param query_begin Index of the first query image, 0 compares all pairs
+ * @param thread_id Number of the particular thread
+ * @param num_threads Total number of threads
+ */
+void calculate_similar_pairs_regions(
+	const std::vector< std::vector< cv::Mat > >& hash_lists,
+	const std::vector< uint64_t >& region_lists,
+	const hash_index& index, unsigned int radius, unsigned int min_votes,
+	const std::vector< long long >& timestamps, long long window,
+	std::map< unsigned long, std::set< unsigned long > >& image_similarities,
+	unsigned long query_begin,
+	unsigned int thread_id, unsigned int num_threads ){
+	
+	const std::vector< cv::Mat >& hash_list = hash_lists.at(0);
+	
+	// number of matching regions for each image, the images with votes,
+	// and the last region of image i that voted for each image
+	std::vector< unsigned short > votes( hash_list.size(), 0 );
+	std::vector< unsigned long > voted, last_vote( hash_list.size(), 0 );
+	
+	// iterate over hash_list (or the query set)
+	for( unsigned long i = query_begin; i < hash_list.size(); i++ ){
+		
+		// check if correct thread for image
+		if( i%num_threads != thread_id )
+			continue;
+		
+		if( !hash_list.at(i).data )
+			continue;
+		
+		for( unsigned int r = 0; r < num_regions; r++ ){
+			
+			uint64_t hash = region_lists.at( i*num_regions + r );
+			unsigned long vote = i*num_regions + r + 1;
+			
+			if( hash == 0 )
+				continue;
+			
+			index.query( hash, [&]( unsigned long id ){
+				
+				unsigned long j = id / num_regions;
+				
+				// each region votes once for each image
+				if( j == i || last_vote.at(j) == vote ||
+					__builtin_popcountll( hash ^ region_lists.at(id) ) > radius ){
+					return;
+				}
+				
+				last_vote.at(j) = vote;
+				if( votes.at(j)++ == 0 )
+					voted.push_back(j);
+			} );
+		}
+		
+		for( auto j : voted ){
+			
+			bool in_window = timestamps.empty() ||
+				timestamps.at(i) == no_timestamp || timestamps.at(j) == no_timestamp ||
+				std::abs( timestamps.at(i) - timestamps.at(j) ) <= window;
+			
+			if( votes.at(j) >= min_votes && in_window ){
+				add_similar_pair( image_similarities, std::max( i, j ),
+					std::min( i, j ) );
+			}
+			
+			votes.at(j) = 0;
+		}
+		voted.clear();
+	}
+}
+
+/**
+ * Recursion function for building the temporary image cluster
+ * (depth-first search)
+ */
+void build_temp_cluster( std::set< unsigned long >& temp_cluster,
+	std::map< unsigned long, std::set< unsigned long > >
+	& image_similarities, unsigned long start ){
+	
+	if(!image_similarities.contains(start)){
+		return;
+	}
+
+	for( auto& i : image_similarities.at(start) ){
+		
+		// is element already in temp_cluster ?
+		if( temp_cluster.contains(i) )
+			continue;
+		
+		// new element:
+		temp_cluster.emplace(i);
+		build_temp_cluster( temp_cluster, image_similarities, i );
+	}
+	
+}
+
+/**
+ * Add the filenames of all images in a directory to file_list
+ * 
+ * @param directory_path Directory of the images, - reads filenames from stdin
+ * @param be_recursive Also load images from subdirectories
+ * @param file_list Stores the filenames
+ * @param archive_members If not nullptr, the members of archives are
+ * added instead of the archives and stored here
+ * @param files If not nullptr, stores the metadata of the files
+ * @param store If not nullptr, all listings are added to the new store
+ * @param reuse_listings Take the listings of unchanged directories from
+ * the old store
+ * @return false if the directory couldn't be opened
+ */
+bool load_file_list( const std::filesystem::path& directory_path,
+	bool be_recursive, std::deque<std::string>& file_list,
+	std::unordered_map< unsigned long, archive_member >* archive_members = nullptr,
+	std::vector< file_info >* files = nullptr, thumbnail_store* store = nullptr,
+	bool reuse_listings = false ){
+	
+	namespace fs = std::filesystem;
+	using entry = thumbnail_store::entry;
+	
+	// add a file, its metadata is from the stat() of the directory entry
+	auto add_file = [&]( const std::string& filename, const file_info& info ){
+		if( archive_members && list_archive( filename, file_list, *archive_members ) )
+			return;
+		file_list.push_back( filename );
+		if( files ){
+			files->resize( file_list.size() );
+			files->back() = info;
+		}
+	};
+	
+	struct stat st;
+	
+	if( directory_path == "-" ){ // load filenames from stdin
+		
+		std::string filename;
+		while( std::getline( std::cin, filename ) ){
+			if( stat( filename.c_str(), &st ) == 0 ){
+				add_file( filename, file_info{ (uint64_t)st.st_size, st.st_dev,
+					st.st_ino, thumbnail_store::mtime_ns( st ) } );
+			} else{
+				add_file( filename, file_info() );
+			}
+		}
+		
+		if( files )
+			files->resize( file_list.size() );
+		return true;
+	}
 	
-	// hash function used for comparison of two hashes
-	cv::Ptr<cv::img_hash::ImgHashBase> hash_func = cv::img_hash::PHash::create();
-
-	// iterate over hash_list
-	for( unsigned long i = 0; i < hash_list.size(); i++ ){
+	// check if path is directory
+	if( !( fs::exists( directory_path ) &&
+		fs::is_directory( directory_path ) ) ){
+		return false;
+	}
+	
+	// Directories modified in the second of this or later are listed again
+	// in the next run (like the racy files of git), because later changes
+	// in the same timestamp tick wouldn't change their modification time.
+	// The file timestamps come from a coarser clock than system_clock.
+	int64_t scan_start = std::chrono::duration_cast< std::chrono::seconds >(
+		std::chrono::system_clock::now().time_since_epoch() ).count();
+	
+	// list a directory, the files are added in the order of
+	// recursive_directory_iterator
+	std::function< void( const fs::path& ) > walk = [&]( const fs::path& directory ){
 		
-		// check if correct thread for image
-		if( i%num_threads != thread_id )
-			continue;
+		struct stat directory_st;
+		if( stat( directory.c_str(), &directory_st ) != 0 )
+			return;
 		
-		if( !hash_list.at(i).data )
-			continue;
+		std::span< const entry > cached;
+		if( store && reuse_listings )
+			cached = store->find_directory( directory.string(), directory_st );
 		
-		for( unsigned long j = i+1; j < hash_list.size(); ++j ){
-			if( !hash_list.at(j).data )
-				continue;
-
-			if(hash_func->compare( hash_list.at(i), hash_list.at(j) ) <= threshold ){
-				mu.lock();
-				if(!image_similarities.contains(i)){
-					image_similarities.emplace(i, std::set<unsigned long>());
+		// files and subdirectories (not followed if they are symlinks)
+		std::vector< std::pair< std::string, entry > > listing;
+		
+		for( const entry& e : cached ){
+			
+			// a damaged listing is not used
+			std::string_view name = store->entry_name( e );
+			if( name.empty() || name == "." || name == ".." ||
+				name.find( '/' ) != std::string_view::npos ){
+				listing.clear();
+				cached = {};
+				break;
+			}
+			listing.emplace_back( name, e );
+		}
+		
+		if( cached.empty() ){
+			std::error_code ec;
+			for( fs::directory_iterator p( directory, ec ), end; !ec && p != end;
+				p.increment( ec ) ){
+				
+				if( stat( p->path().c_str(), &st ) != 0 )
+					continue;
+				
+				bool subdirectory = S_ISDIR( st.st_mode ) && !p->is_symlink();
+				if( S_ISREG( st.st_mode ) || subdirectory ){
+					listing.emplace_back( p->path().filename().string(), entry{
+						(uint64_t)st.st_size, st.st_dev, st.st_ino,
+						thumbnail_store::mtime_ns( st ), 0, 0, subdirectory } );
 				}
-				image_similarities.at(i).emplace(j);
-				mu.unlock();
 			}
 		}
 		
-	}
+		for( auto& [name, e] : listing ){
+			if( !e.is_directory ){
+				add_file( ( directory / name ).string(), file_info{ e.size,
+					(dev_t)e.device, (ino_t)e.inode, e.mtime, !cached.empty() } );
+			} else if( be_recursive ){
+				walk( directory / name );
+			}
+		}
+		
+		if( store && directory_st.st_mtim.tv_sec < scan_start )
+			store->add_directory( directory.string(), directory_st, listing );
+	};
+	
+	walk( directory_path );
+	
+	if( files )
+		files->resize( file_list.size() );
+	return true;
 }
 
 /**
- * Recursion function for building the temporary image cluster
- * (depth-first search)
+ * Find the paths of the same files (hardlinks, symlinks, bind mounts) by
+ * their device and inode
+ * 
+ * @return id of the first path of the file of each image
  */
-void build_temp_cluster( std::set< unsigned long >& temp_cluster,
-	std::map< unsigned long, std::set< unsigned long > >
-	& image_similarities, unsigned long start ){
+std::vector< unsigned long > find_same_files( const std::vector< file_info >& files ){
 	
-	if(!image_similarities.contains(start)){
-		return;
+	std::vector< unsigned long > same_file( files.size() ), by_inode;
+	
+	for( unsigned long i = 0; i < files.size(); i++ ){
+		same_file.at(i) = i;
+		if( files.at(i).inode != 0 )
+			by_inode.push_back(i);
 	}
-
-	for( auto& i : image_similarities.at(start) ){
-		
-		// is element already in temp_cluster ?
-		if( temp_cluster.contains(i) )
-			continue;
-		
-		// new element:
-		temp_cluster.emplace(i);
-		build_temp_cluster( temp_cluster, image_similarities, i );
+	
+	// the first path stays first among the paths of a file
+	std::stable_sort( by_inode.begin(), by_inode.end(),
+		[&]( unsigned long a, unsigned long b ){
+			return std::pair( files.at(a).device, files.at(a).inode ) <
+				std::pair( files.at(b).device, files.at(b).inode );
+		} );
+	
+	for( unsigned long k = 1; k < by_inode.size(); k++ ){
+		const file_info& a = files.at( by_inode.at(k-1) );
+		const file_info& b = files.at( by_inode.at(k) );
+		if( a.device == b.device && a.inode == b.inode )
+			same_file.at( by_inode.at(k) ) = same_file.at( by_inode.at(k-1) );
 	}
 	
+	return same_file;
 }
 
 /**
@@ -180,6 +3922,10 @@ int main( int argc, char* argv[] ){
 	using namespace std;
 	namespace fs = filesystem;
 	
+	// started by decode_image_in_worker
+	if( argc == 2 && strcmp( argv[1], decode_worker_argument ) == 0 )
+		return run_decode_worker();
+	
 	
 	
 	// check arguments
@@ -187,9 +3933,16 @@ int main( int argc, char* argv[] ){
 	
 	int c;
 	bool be_recursive = false, one_line = false;
-	bool flag_directory = false, flag_threshold = false;
-	string string_threshold, string_directory;
-	while( ( c = getopt( argc, argv, "hrd:t:l") ) != -1 ){
+	bool flag_directory = false, flag_threshold = false, flag_query = false;
+	bool flag_window = false, use_blocking = false, colour_thumbnails = false;
+	bool dihedral = false, flag_regions = false, use_archives = false;
+	bool idle_priority = false, largest_first = false, reuse_directories = false;
+	string string_threshold, string_directory, string_query, string_window;
+	string string_store, string_regions, string_budget, string_frames;
+	string string_video, string_pixels, string_seconds, string_cache;
+	string string_bandwidth, string_files;
+	string string_descriptors = "phash";
+	while( ( c = getopt( argc, argv, "hrd:q:t:a:s:cuxM:P:T:o:B:F:eSw:g:n:v:zibl") ) != -1 ){
 		
 		switch(c){
 			case 'h':
@@ -203,10 +3956,76 @@ int main( int argc, char* argv[] ){
 				flag_directory = 1;
 				string_directory = optarg;
 				break;
+			case 'q':
+				flag_query = 1;
+				string_query = optarg;
+				break;
 			case 't':
 				flag_threshold = 1;
 				string_threshold = optarg;
 				break;
+			case 'a':
+				string_descriptors = optarg;
+				break;
+			case 's':
+				string_store = optarg;
+				break;
+			case 'c':
+				colour_thumbnails = true;
+				break;
+			case 'u':
+				reuse_directories = true;
+				break;
+			case 'x':
+				reduced_decoding = false;
+				break;
+			case 'M':
+				string_budget = optarg;
+				break;
+			case 'P':
+				string_pixels = optarg;
+				break;
+			case 'T':
+				string_seconds = optarg;
+				break;
+			case 'o':
+				string_cache = optarg;
+				break;
+			case 'B':
+				string_bandwidth = optarg;
+				break;
+			case 'F':
+				string_files = optarg;
+				break;
+			case 'e':
+				idle_priority = true;
+				break;
+			case 'S':
+				largest_first = true;
+				break;
+			case 'w':
+				flag_window = 1;
+				string_window = optarg;
+				break;
+			case 'g':
+				flag_regions = 1;
+				string_regions = optarg;
+				break;
+			case 'n':
+				string_frames = optarg;
+				break;
+			case 'v':
+				string_video = optarg;
+				break;
+			case 'z':
+				use_archives = true;
+				break;
+			case 'i':
+				dihedral = true;
+				break;
+			case 'b':
+				use_blocking = true;
+				break;
 			case 'l':
 				one_line = true;
 				break;
@@ -222,6 +4041,12 @@ int main( int argc, char* argv[] ){
 		return 0;
 	}
 	
+	// stdin can only provide one of the two file sets
+	if( flag_query && string_directory == "-" && string_query == "-" ){
+		cout << "Error: -d and -q can't both read from stdin\n";
+		return 0;
+	}
+	
 	// this is the threshold, under which images are considered similar
 	double threshold = 0.2;
 	
@@ -233,7 +4058,198 @@ int main( int argc, char* argv[] ){
 			
 		}
 	}
+	
+	// descriptors calculated for each image
+	vector< descriptor > descriptors;
+	
+	if( !parse_descriptors( string_descriptors,
+		flag_threshold ? &threshold : nullptr, descriptors ) ){
+		cout << "Error: invalid argument for -a\n";
+		return 0;
+	}
+	
+	// the first scan of a progressive JPEG is enough for the descriptors
+	// if it is as large as their input, it doesn't need input_size_factor
+	first_scan_min_size = descriptor_input_size( descriptors ) / input_size_factor;
+	if( flag_regions )
+		first_scan_min_size = std::max( first_scan_min_size, region_input_size );
+	
+	// minimum number of matching regions and region threshold
+	unsigned int min_votes = 0, region_radius = 4;
+	
+	if( flag_regions ){
+		// each region of an image votes at most once for another image,
+		// the index splits the hashes into radius+1 chunks
+		long votes = 0, radius = region_radius;
+		try{
+			votes = stol( string_regions );
+			if( string_regions.find( ':' ) != string::npos )
+				radius = stol( string_regions.substr( string_regions.find( ':' ) + 1 ) );
+		} catch( exception &e ){
+			votes = 0;
+		}
+		
+		if( votes < 1 || votes > (long)num_regions || radius < 0 || radius > 63 ){
+			cout << "Error: invalid argument for -g (1-" << num_regions
+				<< " regions, threshold 0-63)\n";
+			return 0;
+		}
+		
+		min_votes = votes;
+		region_radius = radius;
+		
+		// cropped images have a different aspect ratio
+		if( use_blocking || dihedral ){
+			cout << "Error: -g can't be combined with -b or -i\n";
+			return 0;
+		}
+	}
+	
+	// rotated and flipped images are found with the phash descriptor
+	if( dihedral && find_if( descriptors.begin(), descriptors.end(),
+		[]( const descriptor& d ){ return d.name == "phash"; } ) == descriptors.end() ){
+		cout << "Error: -i requires the phash descriptor\n";
+		return 0;
+	}
+	
+	// frames of multi-frame images
+	frame_selection frames;
+	
+	if( !string_frames.empty() ){
+		try{
+			frames.sampled = string_frames.at(0) == 's';
+			frames.count = stoul( string_frames.substr( frames.sampled ) );
+		} catch( exception &e ){
+			cout << "Error: invalid argument for -n\n";
+			return 0;
+		}
+		
+		// the index modes use a single hash per image
+		if( frames.count != 1 && ( dihedral || flag_regions ) ){
+			cout << "Error: -n can't be combined with -g or -i\n";
+			return 0;
+		}
+	}
+	
+	// interval of the hashed video frames
+	if( !string_video.empty() ){
+		try{
+			frames.video_interval = stod( string_video );
+		} catch( exception &e ){
+			frames.video_interval = 0;
+		}
+		
+		if( !( frames.video_interval > 0 ) ){
+			cout << "Error: invalid argument for -v\n";
+			return 0;
+		}
+		
+		if( dihedral || flag_regions ){
+			cout << "Error: -v can't be combined with -g or -i\n";
+			return 0;
+		}
+	}
+	
+	// colormoment needs colour images, blockmean and marrhildreth need
+	// larger images than the thumbnails
+	for( auto& d : descriptors ){
+		if( d.name == "colormoment" && !string_store.empty() && !colour_thumbnails ){
+			cout << "Error: colormoment requires colour thumbnails (-c)\n";
+			return 0;
+		}
+		if( ( d.name == "blockmean" || d.name == "marrhildreth" ) &&
+			!string_store.empty() ){
+			cout << "Error: " << d.name << " can't be used with -s\n";
+			return 0;
+		}
+	}
+	
+	// the directory listings are kept in the thumbnail store
+	if( reuse_directories && string_store.empty() ){
+		cout << "Error: -u requires a thumbnail store (-s)\n";
+		return 0;
+	}
+
+	// only images captured within this many seconds are compared
+	long long window = 0;
+	
+	if( flag_window ){
+		try{
+			window = stoll( string_window );
+		} catch( exception &e ){
+			window = -1;
+		}
+		
+		if( window < 0 ){
+			cout << "Error: invalid argument for -w\n";
+			return 0;
+		}
+	}
+
+	// memory budget for decoded images
+	if( !string_budget.empty() ){
+		try{
+			decode_budget.total = stoull( string_budget ) << 20;
+		} catch( exception &e ){
+			cout << "Error: invalid argument for -M\n";
+			return 0;
+		}
+	}
 
+	// limits of the decoding of a single image
+	try{
+		if( !string_pixels.empty() )
+			max_decode_pixels = stod( string_pixels ) * 1e6;
+	} catch( exception &e ){
+		cout << "Error: invalid argument for -P\n";
+		return 0;
+	}
+	
+	try{
+		if( !string_seconds.empty() )
+			max_decode_seconds = stod( string_seconds );
+	} catch( exception &e ){
+		cout << "Error: invalid argument for -T\n";
+		return 0;
+	}
+	
+	// page cache usage of the image reads
+	if( string_cache == "dontneed" ){
+		page_cache = cache_dontneed;
+	} else if( string_cache == "direct" ){
+		page_cache = cache_direct;
+	} else if( !string_cache.empty() ){
+		cout << "Error: invalid argument for -o\n";
+		return 0;
+	}
+	
+	// rate limits of the hashing stage
+	try{
+		if( !string_bandwidth.empty() )
+			read_limit.rate = stod( string_bandwidth ) * ( 1 << 20 );
+	} catch( exception &e ){
+		cout << "Error: invalid argument for -B\n";
+		return 0;
+	}
+	
+	try{
+		if( !string_files.empty() )
+			open_limit.rate = stod( string_files );
+	} catch( exception &e ){
+		cout << "Error: invalid argument for -F\n";
+		return 0;
+	}
+	
+	// the priorities are inherited by all threads and decoding processes
+	// created later
+	if( idle_priority ){
+		setpriority( PRIO_PROCESS, 0, 19 );
+#ifdef SYS_ioprio_set
+		// IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE
+		syscall( SYS_ioprio_set, 1, 0, 3 << 13 );
+#endif
+	}
+	
 	// create threads
     //******************************************************************
 	unsigned int num_threads = (thread::hardware_concurrency()!=0) ?
@@ -250,87 +4266,302 @@ int main( int argc, char* argv[] ){
 	// To save memory, each file is identified by an unsigned long
 	// instead of a string.
 	deque<string> file_list;
-    fs::path directory_path = string_directory;
-    
-    if( directory_path == "-" ){ // load filenames from stdin
+	
+	// images in archives with -z
+	unordered_map< unsigned long, archive_member > archive_members;
+	auto* members = use_archives ? &archive_members : nullptr;
+	
+	// sizes for -S and inodes of the files
+	vector< file_info > files;
+	
+	// thumbnails of the images and the directory listings, which are
+	// only used with -u
+	thumbnail_store store;
+	auto* listings = string_store.empty() ? nullptr : &store;
+	
+	if( !string_store.empty() )
+		store.load( string_store, colour_thumbnails ? 3 : 1 );
+	
+	if( !load_file_list( string_directory, be_recursive, file_list, members, &files,
+		listings, reuse_directories ) ){
+		cout << "Error: Couldn't open " << fs::path(string_directory) << endl;
+		return 0;
+	}
+	
+	// In the bipartite mode the query images are appended to the
+	// reference images, query_begin is the id of the first query image.
+	unsigned long query_begin = 0;
+	
+	if( flag_query ){
+		query_begin = file_list.size();
 		
-		string filename;
-		while( getline( cin, filename ) ){
-			file_list.push_back( filename );
+		if( !load_file_list( string_query, be_recursive, file_list, members, &files,
+			listings, reuse_directories ) ){
+			cout << "Error: Couldn't open " << fs::path(string_query) << endl;
+			return 0;
 		}
 		
-	} else{ // load from directory
-		// check if path is directory
-		if( !( fs::exists( directory_path ) &&
-			fs::is_directory( directory_path ) ) ){
-			
-			cout << "Error: Couldn't open " << directory_path << endl;
+		// nothing to compare the query images against
+		if( query_begin == 0 ){
+			if(!one_line)
+				cout << "No reference images.\n";
 			return 0;
 		}
+	}
+	
+	if(!one_line){
+		if( flag_query ){
+			cout << "Filelist created, " << query_begin << " reference files, "
+				<< file_list.size() - query_begin << " query files.\n";
+		} else{
+			cout << "Filelist created, " << file_list.size() << " files.\n";
+		}
+	}
+	
+	// further paths of a file are not decoded, they get the hashes of the
+	// first path
+	vector< unsigned long > same_file = find_same_files( files );
+	unsigned long num_same = 0;
+	for( unsigned long i = 0; i < file_list.size(); i++ ){
+		if( same_file.at(i) != i )
+			num_same++;
+	}
+	
+	if( !one_line && num_same > 0 )
+		cout << "Found " << num_same << " further paths of the same files.\n";
+	
+	
+	
+	// skip images without another image of a similar aspect ratio
+	//******************************************************************
+	
+	vector< bool > blocked;
+	
+	if( use_blocking ){
+		
+		vector< long > buckets( file_list.size() );
+		
+		for( unsigned int i = 0; i < num_threads; ++i ){
+			t.at(i) = thread( calculate_aspect_buckets, ref(file_list), ref(buckets), i, num_threads );
+		}
+		for( unsigned int i = 0; i < num_threads; ++i ){
+			t.at(i).join();
+		}
 		
-		// load filenames
-		if( be_recursive ){
+		// number of images in each bucket, separate for the query set
+		map< long, unsigned long > bucket_sizes, query_bucket_sizes;
+		for( unsigned long i = 0; i < file_list.size(); i++ ){
+			if( buckets.at(i) != no_bucket )
+				( query_begin && i >= query_begin ? query_bucket_sizes : bucket_sizes )[ buckets.at(i) ]++;
+		}
+		
+		// Images in neighbouring buckets are possible partners, in the
+		// bipartite mode the partners have to be from the other set.
+		// Images with unrecognized headers are never blocked. With -i
+		// the buckets of the rotated aspect ratio are added.
+		blocked.resize( file_list.size() );
+		unsigned long num_blocked = 0;
+		
+		for( unsigned long i = 0; i < file_list.size(); i++ ){
 			
-			// recurse directory and add filenames to deque
-			for( auto p:
-				fs::recursive_directory_iterator( directory_path ) ){
-				
-				if( fs::is_regular_file(p.path()) ) {
-					file_list.push_back( p.path().string() );
-				}
-				
-			}
+			if( buckets.at(i) == no_bucket )
+				continue;
 			
-		} else{
+			bool is_query = query_begin && i >= query_begin;
+			auto& partner_sizes = ( query_begin && !is_query ) ?
+				query_bucket_sizes : bucket_sizes;
 			
-			for( auto p: fs::directory_iterator( directory_path ) ){
-				
-				if( fs::is_regular_file(p.path()) ) {
-					file_list.push_back( p.path().string() );
-				}
-				
+			set< long > partner_buckets;
+			for( long b = buckets.at(i) - 1; b <= buckets.at(i) + 1; b++ )
+				partner_buckets.insert( b );
+			for( long b = -buckets.at(i) - 2; dihedral && b <= -buckets.at(i) + 1; b++ )
+				partner_buckets.insert( b );
+			
+			unsigned long partners = 0;
+			for( long b : partner_buckets ){
+				if( partner_sizes.contains(b) )
+					partners += partner_sizes.at(b);
 			}
 			
+			// the image itself is counted in the all-pairs mode
+			if( !query_begin )
+				partners--;
+			
+			if( partners == 0 ){
+				blocked.at(i) = true;
+				num_blocked++;
+			}
 		}
+		
+		if(!one_line)
+			cout << "Read image headers, skipping " << num_blocked << " files.\n";
 	}
 	
-	if(!one_line)
-		cout << "Filelist created, " << file_list.size() << " files.\n";
-	
-	
 	
 	// calculate perceptual hash for each file
 	//******************************************************************
 	
-	std::vector< cv::Mat > hash_list;
+	// one list of hash values per descriptor
+	std::vector< std::vector< cv::Mat > > hash_lists( descriptors.size(),
+		std::vector< cv::Mat >( file_list.size() ) );
+	
+	// capture times are only read in the time window mode
+	std::vector< long long > timestamps;
+	
+	// eight PHash variants per image with -i
+	std::vector< uint64_t > dihedral_lists( dihedral ? file_list.size() * 8 : 0 );
+	
+	// num_regions hashes per image with -g
+	std::vector< uint64_t > region_lists( flag_regions ? file_list.size() * num_regions : 0 );
+	
+	if( !string_store.empty() && !store.create( file_list.size() ) ){
+		cout << "Error: Couldn't create thumbnail store " << string_store << endl;
+		return 0;
+	}
 
-	hash_list.resize( file_list.size() );
+	if( flag_window )
+		timestamps.resize( file_list.size(), no_timestamp );
+	
+	// blocked images and further paths of a file aren't decoded
+	vector< bool > skipped = blocked;
+	skipped.resize( file_list.size() );
+	for( unsigned long i = 0; i < file_list.size(); i++ ){
+		if( same_file.at(i) != i )
+			skipped.at(i) = true;
+	}
+	
+	hash_schedule schedule( file_list, skipped, archive_members, files, store,
+		largest_first );
+	
     for( unsigned int i = 0; i < num_threads; ++i ){
-		t.at(i) = thread( calculate_hash_values, ref(file_list), ref(hash_list), i, num_threads );
+		t.at(i) = thread( calculate_hash_values, ref(file_list), ref(schedule), ref(files), ref(descriptors), ref(hash_lists), ref(timestamps), ref(store), ref(dihedral_lists), ref(region_lists), ref(frames), ref(archive_members), i, num_threads );
 	}
     for( unsigned int i = 0; i < num_threads; ++i ){
 		t.at(i).join();
 	}
+	
+	// copy the hashes to the further paths of a file, they are found as
+	// identical images
+	for( unsigned long i = 0; i < file_list.size(); i++ ){
+		
+		unsigned long first = same_file.at(i);
+		if( first == i )
+			continue;
+		
+		for( auto& hash_list : hash_lists )
+			hash_list.at(i) = hash_list.at( first );
+		if( !timestamps.empty() )
+			timestamps.at(i) = timestamps.at( first );
+		if( !dihedral_lists.empty() ){
+			copy_n( dihedral_lists.begin() + first*8, 8, dihedral_lists.begin() + i*8 );
+		}
+		if( !region_lists.empty() ){
+			copy_n( region_lists.begin() + first*num_regions, num_regions,
+				region_lists.begin() + i*num_regions );
+		}
+		if( store.fd >= 0 )
+			store.copy( first, i );
+	}
 
-	if(!one_line)
+	if( !string_store.empty() && !store.close( file_list ) )
+		cerr << "Error: Couldn't write thumbnail store " << string_store << endl;
+
+	if( !one_line && !string_store.empty() ){
+		cout << "Finished hash calculations, " << store.hits <<
+			" images from the thumbnail store.\n";
+	} else if(!one_line){
 		cout << "Finished hash calculations.\n";
+	}
 	
 	
 	// create map of images to their similar images
 	//******************************************************************
 
 	map< unsigned long, set< unsigned long > > image_similarities;
+	
+	// images with capture time sorted by time, and their positions
+	vector< unsigned long > time_order, time_rank;
+	
+	if( flag_window ){
+		for( unsigned long i = 0; i < file_list.size(); i++ ){
+			if( timestamps.at(i) != no_timestamp )
+				time_order.push_back(i);
+		}
+		
+		stable_sort( time_order.begin(), time_order.end(),
+			[&]( unsigned long a, unsigned long b ){
+				return timestamps.at(a) < timestamps.at(b);
+			} );
+		
+		time_rank.resize( file_list.size() );
+		for( unsigned long k = 0; k < time_order.size(); k++ )
+			time_rank.at( time_order.at(k) ) = k;
+	}
+
+	// index of the reference images (or all images) with -i
+	hash_index index;
+	bool exact = false;
+	
+	if( dihedral ){
+		
+		for( auto& d : descriptors ){
+			if( d.name == "phash" )
+				exact = d.threshold < 1;
+		}
+		
+		// index the canonical variant for exact matches
+		vector< uint64_t > keys( file_list.size() );
+		vector< unsigned long > ids;
+		
+		for( unsigned long i = 0; i < ( query_begin ? query_begin : file_list.size() ); i++ ){
+			if( hash_lists.at(0).at(i).data ){
+				keys.at(i) = exact ? *min_element( &dihedral_lists.at( i*8 ),
+					&dihedral_lists.at( i*8 ) + 8 ) : dihedral_lists.at( i*8 );
+				ids.push_back(i);
+			}
+		}
+		
+		unsigned int radius = 0;
+		for( auto& d : descriptors ){
+			if( d.name == "phash" )
+				radius = std::max( 0.0, std::min( d.threshold, 64.0 ) );
+		}
+		index.build( keys, ids, exact ? 0 : radius );
+	}
+	
+	// index of the region hashes of the reference images (or all images)
+	if( flag_regions ){
+		
+		vector< unsigned long > ids;
+		
+		for( unsigned long i = 0; i < ( query_begin ? query_begin : file_list.size() ); i++ ){
+			for( unsigned int r = 0; r < num_regions; r++ ){
+				if( region_lists.at( i*num_regions + r ) != 0 )
+					ids.push_back( i*num_regions + r );
+			}
+		}
+		
+		index.build( region_lists, ids, region_radius );
+	}
 
 	for( unsigned int i = 0; i < num_threads; ++i ){
-		t.at(i) = thread( calculate_similar_pairs, ref(hash_list), ref(image_similarities), threshold, i, num_threads );
+		if( flag_regions ){
+			t.at(i) = thread( calculate_similar_pairs_regions, ref(hash_lists), ref(region_lists), ref(index), region_radius, min_votes, ref(timestamps), window, ref(image_similarities), query_begin, i, num_threads );
+		} else if( dihedral ){
+			t.at(i) = thread( calculate_similar_pairs_dihedral, ref(hash_lists), ref(descriptors), ref(dihedral_lists), ref(index), exact, ref(timestamps), window, ref(image_similarities), query_begin, i, num_threads );
+		} else if( flag_window ){
+			t.at(i) = thread( calculate_similar_pairs_in_window, ref(hash_lists), ref(descriptors), ref(timestamps), ref(time_order), ref(time_rank), ref(image_similarities), window, query_begin, i, num_threads );
+		} else{
+			t.at(i) = thread( calculate_similar_pairs, ref(hash_lists), ref(descriptors), ref(image_similarities), query_begin, i, num_threads );
+		}
 	}
     for( unsigned int i = 0; i < num_threads; ++i ){
 		t.at(i).join();
 	}
 
 	// hashes are no longer needed
-	hash_list.clear();
-	hash_list.shrink_to_fit();
+	hash_lists.clear();
+	hash_lists.shrink_to_fit();
 
 	if(!one_line)
 		cout << "Adjacency lists created.\n";